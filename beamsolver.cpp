@@ -0,0 +1,289 @@
+#include "beamsolver.h"
+#include "puzzle.h"
+#include <algorithm>
+#include <unordered_set>
+
+// Well mixed 64-bit hash of one link
+static uint64_t hashLink(uint32_t a, TILE_POS face, uint32_t b)
+{
+	// Same link when seen from the other tile
+	if (b < a) {
+		std::swap(a, b);
+		face = swapTilePos(face);
+	}
+	uint64_t x = ((uint64_t)a << 34) ^ ((uint64_t)b << 2) ^ face;
+	// splitmix64 finalizer
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+BeamSolver::Node::~Node()
+{
+	(*live)--;
+
+	// Free long chains without recursion
+	NodePtr p = std::move(parent);
+	while (p && p.use_count() == 1) {
+		NodePtr next = std::move(p->parent);
+		p = std::move(next);
+	}
+}
+
+BeamSolver::BeamSolver(Puzzle &puzzle, size_t width, size_t memory_mib) :
+	m_puzzle(puzzle),
+	m_width(std::max<size_t>(width, 1)),
+	m_memory(memory_mib << 20)
+{
+}
+
+size_t BeamSolver::run(const Deadline &deadline)
+{
+	Timer t_("BeamSolver::run");
+
+	m_beams.clear();
+	m_beams.push_back(nullptr);
+	m_undone = 0;
+
+	auto get_depth = [] (const NodePtr &n) -> uint32_t {
+		return n ? n->depth : 0;
+	};
+	// Further first, then lower score
+	auto is_better = [&] (const NodePtr &a, const NodePtr &b) {
+		if (get_depth(a) != get_depth(b))
+			return get_depth(a) > get_depth(b);
+		return a && b && a->score < b->score;
+	};
+
+	NodePtr best;
+	bool best_set = false;
+	std::vector<Child> children;
+	std::unordered_set<uint64_t> seen;
+
+	while (!m_beams.empty()) {
+		if (deadline.expired()) {
+			for (const NodePtr &beam : m_beams) {
+				if (!best_set || is_better(beam, best)) {
+					best = beam;
+					best_set = true;
+				}
+			}
+			WARN("Time budget exceeded after " << get_depth(best) << " merges");
+			break;
+		}
+
+		children.clear();
+		for (size_t i = 0; i < m_beams.size() && !deadline.expired(); ++i) {
+			size_t n = children.size();
+			expand(i, children);
+
+			// Dead end: keep it when it got the furthest
+			const NodePtr &beam = m_beams[i];
+			if (children.size() == n && (!best_set || is_better(beam, best))) {
+				best = beam;
+				best_set = true;
+			}
+		}
+
+		if (deadline.expired())
+			continue; // Incomplete round, handled above
+
+		// Best first, the same state reached in different orders only once
+		std::sort(children.begin(), children.end(),
+				[] (const Child &a, const Child &b) {
+			if (a.score != b.score)
+				return a.score < b.score;
+			return a.hash < b.hash;
+		});
+
+		size_t bytes = m_live_nodes * sizeof(Node)
+			+ children.capacity() * sizeof(Child);
+		if (bytes > m_memory && m_width > 1) {
+			m_width = (m_width + 1) / 2;
+			WARN("Memory budget exceeded, beam width reduced to " << m_width);
+		}
+
+		std::vector<const Child *> picked;
+		seen.clear();
+		for (const Child &c : children) {
+			if (picked.size() >= m_width)
+				break;
+			if (seen.insert(c.hash).second)
+				picked.push_back(&c);
+		}
+		// Siblings next to each other: the beams stay in the order of the tree
+		std::stable_sort(picked.begin(), picked.end(),
+				[] (const Child *a, const Child *b) {
+			return a->beam < b->beam;
+		});
+
+		std::vector<NodePtr> next;
+		for (const Child *c : picked) {
+			const NodePtr &parent = m_beams[c->beam];
+			m_live_nodes++;
+			next.push_back(NodePtr(new Node { parent, c->t1, c->t2, c->face,
+				parent ? parent->depth + 1 : 1, c->score, c->hash, &m_live_nodes }));
+		}
+		m_beams = std::move(next);
+	}
+
+	moveTo(best.get());
+	for (size_t i = 0; i < m_applied.size(); ++i)
+		m_puzzle.commit();
+	m_applied.clear();
+
+	size_t merged = best ? best->depth : 0;
+	LOG("Merged " << merged << " times, score=" << (best ? best->score : 0)
+		<< ", " << m_puzzle.pool.size() - merged << " fragments left, "
+		<< m_undone << " merges rolled back to switch beams");
+	return merged;
+}
+
+void BeamSolver::moveTo(const Node *node)
+{
+	std::vector<const Node *> path;
+	for (const Node *n = node; n; n = n->parent.get())
+		path.push_back(n);
+	std::reverse(path.begin(), path.end());
+
+	size_t common = 0;
+	while (common < path.size() && common < m_applied.size()
+			&& path[common] == m_applied[common])
+		common++;
+
+	while (m_applied.size() > common) {
+		m_puzzle.rollback();
+		m_applied.pop_back();
+		m_undone++;
+	}
+
+	for (size_t i = common; i < path.size(); ++i) {
+		const Node *n = path[i];
+		m_puzzle.begin();
+		if (!m_puzzle.mergeFragments(m_puzzle.pool[n->t1], n->face, m_puzzle.pool[n->t2]))
+			ERROR("Cannot replay merge of " << n->t1 << " and " << n->t2);
+		m_applied.push_back(n);
+	}
+}
+
+void BeamSolver::expand(size_t beam, std::vector<Child> &out)
+{
+	const NodePtr &node = m_beams[beam];
+	moveTo(node.get());
+
+	// Pre-select the possible links by the distance of the two faces alone
+	struct Link {
+		int diff;
+		uint32_t t1, t2;
+		TILE_POS face;
+
+		bool operator==(const Link &o) const
+		{
+			return t1 == o.t1 && t2 == o.t2 && face == o.face;
+		}
+		bool operator<(const Link &o) const
+		{
+			if (diff != o.diff)
+				return diff < o.diff;
+			if (t1 != o.t1)
+				return t1 < o.t1;
+			if (face != o.face)
+				return face < o.face;
+			return t2 < o.t2;
+		}
+	};
+	// Max-heap of the best "m_width" links
+	std::vector<Link> best;
+	const Fragments &fragments = m_puzzle.fragments;
+
+	// out: false if "diff" cannot make it into "best"
+	auto consider = [&] (Tile *t1, TILE_POS face, Tile *t2, int diff) -> bool {
+		if (best.size() >= m_width && diff > best.front().diff)
+			return false;
+
+		TILE_POS o_face = swapTilePos(face);
+		if (t2 == t1 || t2->getNeighbour(o_face))
+			return true;
+		if (fragments.getRoot(t1) == fragments.getRoot(t2))
+			return true;
+
+		// Same link when found from the other tile
+		Link link { diff, t1->index, t2->index, face };
+		if (t2->index < t1->index)
+			link = Link { diff, t2->index, t1->index, o_face };
+		if (std::find(best.begin(), best.end(), link) != best.end())
+			return true;
+		if (!fragments.canMerge(t1, t2, face))
+			return true; // overlap
+
+		if (best.size() < m_width) {
+			best.push_back(link);
+			std::push_heap(best.begin(), best.end());
+		} else if (link < best.front()) {
+			std::pop_heap(best.begin(), best.end());
+			best.back() = link;
+			std::push_heap(best.begin(), best.end());
+		}
+		return true;
+	};
+
+	// Faces without free listed partners. diff = lower bound
+	std::vector<Link> exhausted;
+
+	// The lists as built on startup, not CandidateIndex::get: it rebuilds
+	// them for the links of the current beam, which other beams do not have.
+	for (Tile *t1 : m_puzzle.pool) {
+		if (t1->link_count >= TP_TOTAL)
+			continue;
+
+		for (int face = 0; face < TP_TOTAL; ++face) {
+			if (t1->getNeighbour((TILE_POS)face))
+				continue;
+
+			TILE_POS o_face = swapTilePos(face);
+			const std::vector<Candidate> &list = m_puzzle.candidates.peek(t1, (TILE_POS)face);
+			bool any_free = false;
+			for (const Candidate &c : list) {
+				any_free |= !c.tile->getNeighbour(o_face);
+				// Sorted: none of the remaining ones can be better
+				if (!consider(t1, (TILE_POS)face, c.tile, c.diff))
+					break;
+			}
+			if (!any_free && !list.empty())
+				exhausted.push_back(Link { list.back().diff, t1->index, 0, (TILE_POS)face });
+		}
+	}
+
+	// All listed partners are taken in this beam: compare all tiles.
+	// The others are not closer than the last listed one.
+	std::sort(exhausted.begin(), exhausted.end());
+	for (const Link &e : exhausted) {
+		if (best.size() >= m_width && e.diff > best.front().diff)
+			break;
+
+		Tile *t1 = m_puzzle.pool[e.t1];
+		TILE_POS o_face = swapTilePos(e.face);
+		for (Tile *t2 : m_puzzle.pool) {
+			if (t2 != t1 && !t2->getNeighbour(o_face))
+				consider(t1, e.face, t2, m_puzzle.getFaceDistance(t1, e.face, t2));
+		}
+	}
+	std::sort(best.begin(), best.end());
+
+	for (const Link &link : best) {
+		int64_t sum = 0;
+		int64_t count = 0;
+		uint64_t hash = node ? node->hash : 0;
+		bool ok = fragments.forEachContact(m_puzzle.pool[link.t1], m_puzzle.pool[link.t2],
+				link.face, [&] (Tile *a, TILE_POS a_face, Tile *b) {
+			sum += m_puzzle.getFaceDistance(a, a_face, b);
+			count++;
+			hash += hashLink(a->index, a_face, b->index);
+		});
+		if (!ok || count == 0)
+			continue; // overlap
+
+		out.push_back(Child { beam, link.t1, link.t2, link.face,
+			(node ? node->score : 0) + sum / count, hash });
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "tile.h"
+#include "util/timer.h"
+#include <memory>
+#include <vector>
+
+class Puzzle;
+
+// Keeps the "width" best partial assemblies instead of a single one, so an
+// early bad merge can be outscored by another branch later on.
+// A beam is a chain of merges. Beams share their common history: only the
+// last merge is stored per node, the rest is the parent chain. The puzzle
+// holds one beam at a time, switching between them is done by rolling back
+// to the common parent (one journal level per merge) and replaying the rest.
+// The beams are visited in the order of the tree, so each node is applied
+// at most once per round. Beams that diverged early still cost a replay of
+// all their merges since the split.
+// Expanding a beam scans the candidate lists of all free faces. Faces whose
+// listed partners are all taken compare all tiles: O(N) each, thus up to
+// O(N^2) per beam and round late in the search.
+class BeamSolver {
+public:
+	// "memory_mib": limit for the search nodes, the width shrinks beyond
+	BeamSolver(Puzzle &puzzle, size_t width, size_t memory_mib);
+
+	// Applies the best assembly to the puzzle. Once "deadline" expired,
+	// the best one among the unfinished beams counts as well.
+	// out: number of merges
+	size_t run(const Deadline &deadline = Deadline());
+
+private:
+	struct Node {
+		std::shared_ptr<Node> parent; // nullptr: unsolved puzzle
+		uint32_t t1, t2;
+		TILE_POS face; // of t1
+		uint32_t depth; // number of merges
+		int64_t score; // sum of the mean contact distance of each merge
+		uint64_t hash; // of all links, independent of the merge order
+		size_t *live;
+
+		~Node();
+	};
+	typedef std::shared_ptr<Node> NodePtr;
+
+	struct Child {
+		size_t beam; // index of the parent
+		uint32_t t1, t2;
+		TILE_POS face;
+		int64_t score;
+		uint64_t hash;
+	};
+
+	// Puts the state of "node" onto the puzzle
+	void moveTo(const Node *node);
+	void expand(size_t beam, std::vector<Child> &out);
+
+	Puzzle &m_puzzle;
+	size_t m_width;
+	size_t m_memory;
+
+	std::vector<NodePtr> m_beams;
+	// Merges currently applied to the puzzle, each with its own journal level
+	std::vector<const Node *> m_applied;
+	size_t m_live_nodes = 0;
+	size_t m_undone = 0; // merges rolled back by moveTo
+};
@@ -0,0 +1,110 @@
+#include "candidates.h"
+#include "puzzle.h"
+#include "util/parallel.h"
+#include "util/timer.h"
+#include <algorithm>
+
+void CandidateIndex::build(TileStore &pool, const CompatMatrix &compat, size_t k,
+		const Deadline &deadline)
+{
+	Timer t_("CandidateIndex::build");
+	clear();
+
+	m_pool = &pool;
+	m_compat = &compat;
+	m_k = k;
+	m_lists.resize(pool.size() * TP_TOTAL);
+
+	parallelFor(pool.size(), [&] (size_t i) {
+		if (deadline.expired())
+			return;
+
+		for (int face = 0; face < TP_TOTAL; ++face)
+			rebuild(pool[i], (TILE_POS)face);
+	});
+
+	if (deadline.expired()) {
+		WARN("Time budget exceeded");
+		clear();
+		return;
+	}
+	LOG("Top " << k << " partners for " << pool.size() << " tiles");
+}
+
+void CandidateIndex::clear()
+{
+	m_pool = nullptr;
+	m_compat = nullptr;
+	m_lists.clear();
+	m_k = 0;
+}
+
+void CandidateIndex::rebuild(Tile *tile, TILE_POS face)
+{
+	TILE_POS o_face = swapTilePos(face);
+	List &list = m_lists[tile->index * TP_TOTAL + face];
+	std::vector<Candidate> &entries = list.entries;
+
+	entries.clear();
+	for (Tile *other : *m_pool) {
+		if (other == tile || other->getNeighbour(o_face))
+			continue;
+
+		int diff;
+		if (!m_compat->empty())
+			diff = m_compat->get(tile->index, other->index)[face];
+		else
+			diff = tile->getFace(face).getDistance(other->getFace(o_face));
+
+		entries.push_back(Candidate { other, diff });
+	}
+
+	auto cmp = [] (const Candidate &a, const Candidate &b) {
+		return a.diff < b.diff
+			|| (a.diff == b.diff && a.tile->index < b.tile->index);
+	};
+
+	if (entries.size() > m_k) {
+		std::partial_sort(entries.begin(), entries.begin() + m_k,
+			entries.end(), cmp);
+		entries.resize(m_k);
+	} else {
+		std::sort(entries.begin(), entries.end(), cmp);
+	}
+	list.n_free = entries.size();
+}
+
+const std::vector<Candidate> &CandidateIndex::get(Tile *tile, TILE_POS face)
+{
+	List &list = m_lists[tile->index * TP_TOTAL + face];
+
+	TILE_POS o_face = swapTilePos(face);
+	size_t n_free = 0;
+	for (const Candidate &c : list.entries) {
+		if (!c.tile->getNeighbour(o_face))
+			n_free++;
+	}
+
+	// Lazy rebuild once more than half of the partners are gone
+	if (n_free * 2 < list.n_free)
+		rebuild(tile, face);
+
+	return list.entries;
+}
+
+void CandidateIndex::getAll(Tile *tile, std::vector<Tile *> &out)
+{
+	out.clear();
+	for (int face = 0; face < TP_TOTAL; ++face) {
+		if (tile->getNeighbour((TILE_POS)face))
+			continue;
+
+		for (const Candidate &c : get(tile, (TILE_POS)face))
+			out.push_back(c.tile);
+	}
+
+	std::sort(out.begin(), out.end(), [] (const Tile *a, const Tile *b) {
+		return a->index < b->index;
+	});
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+}
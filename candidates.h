@@ -0,0 +1,49 @@
+#pragma once
+
+#include "tile.h"
+#include "util/timer.h"
+
+class CompatMatrix;
+
+struct Candidate {
+	Tile *tile;
+	int diff;
+};
+
+// Best k partner tiles for each (tile, face), sorted by distance.
+// The solvers only evaluate these instead of all other tiles.
+class CandidateIndex {
+public:
+	// Must be called after CompatMatrix::build.
+	// Stays empty if "deadline" expires meanwhile.
+	void build(TileStore &pool, const CompatMatrix &compat, size_t k,
+		const Deadline &deadline = Deadline());
+	void clear();
+
+	inline bool empty() const { return m_lists.empty(); }
+
+	// Partners whose opposite face was free when the list was built.
+	// Lists are rebuilt on access once most partners got occupied.
+	const std::vector<Candidate> &get(Tile *tile, TILE_POS face);
+
+	// As last built, without the rebuild of get(): partners may be occupied.
+	// Does not depend on the links made since then.
+	inline const std::vector<Candidate> &peek(const Tile *tile, TILE_POS face) const
+	{ return m_lists[tile->index * TP_TOTAL + face].entries; }
+
+	// Union of get() over all free faces of "tile", sorted by pool index
+	void getAll(Tile *tile, std::vector<Tile *> &out);
+
+private:
+	struct List {
+		std::vector<Candidate> entries;
+		size_t n_free; // free partners at build time
+	};
+
+	void rebuild(Tile *tile, TILE_POS face);
+
+	TileStore *m_pool = nullptr;
+	const CompatMatrix *m_compat = nullptr;
+	std::vector<List> m_lists;
+	size_t m_k = 0;
+};
@@ -0,0 +1,79 @@
+#include "compat.h"
+#include "puzzle.h"
+#include "util/parallel.h"
+#include "util/timer.h"
+
+// Tiles per block edge. 64x64 tiles x 4 faces x 16 colors fit into L2.
+#define COMPAT_BLOCK 64
+// Upper limit of the table size
+#define COMPAT_MAX_BYTES (1024ULL * 1024 * 1024)
+
+void CompatMatrix::build(TileStore &pool, const Deadline &deadline)
+{
+	clear();
+
+	size_t n = pool.size();
+	if (n * n * TP_TOTAL * sizeof(uint16_t) > COMPAT_MAX_BYTES) {
+		WARN("Too many tiles (" << n << "). Computing distances on demand.");
+		return;
+	}
+
+	Timer t_("CompatMatrix::build");
+	m_data.resize(n * n * TP_TOTAL);
+
+	// The distance is symmetric: d(a, b, face) == d(b, a, swap(face))
+	// Only blocks with bx >= by are computed; each fills both halves.
+	size_t n_blocks = (n + COMPAT_BLOCK - 1) / COMPAT_BLOCK;
+	std::vector<std::pair<size_t, size_t>> jobs;
+	for (size_t by = 0; by < n_blocks; ++by)
+	for (size_t bx = by; bx < n_blocks; ++bx)
+		jobs.emplace_back(by, bx);
+
+	parallelFor(jobs.size(), [&] (size_t job) {
+		if (deadline.expired())
+			return;
+
+		size_t a_start = jobs[job].first * COMPAT_BLOCK;
+		size_t b_start = jobs[job].second * COMPAT_BLOCK;
+		size_t a_end = std::min(a_start + COMPAT_BLOCK, n);
+		size_t b_end = std::min(b_start + COMPAT_BLOCK, n);
+
+		for (size_t a = a_start; a < a_end; ++a)
+		for (size_t b = (a_start == b_start ? a : b_start); b < b_end; ++b) {
+			Face mine_f[TP_TOTAL], theirs_f[TP_TOTAL];
+			const Face *mine[TP_TOTAL], *theirs[TP_TOTAL];
+			for (int i = 0; i < TP_TOTAL; ++i) {
+				mine_f[i] = pool.getFace(a, (TILE_POS)i);
+				theirs_f[i] = pool.getFace(b, swapTilePos(i));
+				mine[i] = &mine_f[i];
+				theirs[i] = &theirs_f[i];
+			}
+			int dist[TP_TOTAL];
+			Face::getDistance4(mine, theirs, dist);
+
+			uint16_t *ab = &m_data[(a * n + b) * TP_TOTAL];
+			uint16_t *ba = &m_data[(b * n + a) * TP_TOTAL];
+			for (int i = 0; i < TP_TOTAL; ++i) {
+				ab[i] = dist[i];
+				ba[swapTilePos(i)] = dist[i];
+			}
+		}
+	});
+
+	if (deadline.expired()) {
+		WARN("Time budget exceeded. Computing distances on demand.");
+		clear();
+		return;
+	}
+
+	m_size = n;
+	LOG("Precomputed " << n << "x" << n << " tile pairs, "
+		<< (m_data.size() * sizeof(uint16_t) / 1024) << " KiB");
+}
+
+void CompatMatrix::clear()
+{
+	m_data.clear();
+	m_data.shrink_to_fit();
+	m_size = 0;
+}
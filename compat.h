@@ -0,0 +1,28 @@
+#pragma once
+
+#include "tile.h"
+#include "util/timer.h"
+
+// Precomputed face distances of all tile pairs.
+// Face data no longer changes after Image::read, thus the solver
+// only needs to look up the values instead of comparing the colors again.
+class CompatMatrix {
+public:
+	// Fills the table on all cores. Skipped for too large puzzles, and
+	// dropped again if "deadline" expires meanwhile.
+	void build(TileStore &pool, const Deadline &deadline = Deadline());
+	void clear();
+
+	inline bool empty() const { return m_size == 0; }
+
+	// Distances of tile "a" to tile "b" for each face of "a",
+	// compared against the opposite face of "b"
+	inline const uint16_t *get(uint32_t a, uint32_t b) const
+	{
+		return &m_data[((size_t)a * m_size + b) * TP_TOTAL];
+	}
+
+private:
+	std::vector<uint16_t> m_data;
+	size_t m_size = 0;
+};
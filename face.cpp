@@ -0,0 +1,145 @@
+#include "tile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define HAVE_X86_KERNELS
+	#include <immintrin.h>
+#endif
+
+// Shared by all kernels: penalize faces without any contrast
+static inline int finishDistance(int sad, const Face &a, const Face &b)
+{
+	int diff = sad + ((int)512 - a.variance - b.variance);
+
+	if (diff < 0)
+		diff = 0;
+
+	return diff;
+}
+
+// ============ Scalar reference ============
+
+static int distanceScalar(const Face &a, const Face &b)
+{
+	int diff = 0;
+	for (int i = 0; i < SEGNUM; ++i)
+		diff += ABS(a.colors[i] - b.colors[i]);
+
+	/*int variety = 0;
+	for (int i = 0; i < SEGNUM - 1; ++i)
+		variety += ABS(colors[i] - colors[i + 1]);*/
+
+	return finishDistance(diff, a, b);
+}
+
+static void distance4Scalar(const Face *const a[4], const Face *const b[4], int out[4])
+{
+	for (int i = 0; i < 4; ++i)
+		out[i] = distanceScalar(*a[i], *b[i]);
+}
+
+static const FaceKernel s_kernel_scalar = {
+	"scalar", distanceScalar, distance4Scalar
+};
+
+#ifdef HAVE_X86_KERNELS
+static_assert(SEGNUM == 16, "SIMD kernels expect one face per 128-bit lane");
+
+// ============ SSE2: one psadbw per face pair ============
+
+__attribute__((target("sse2")))
+static int distanceSSE2(const Face &a, const Face &b)
+{
+	__m128i va = _mm_loadu_si128((const __m128i *)a.colors);
+	__m128i vb = _mm_loadu_si128((const __m128i *)b.colors);
+	__m128i sad = _mm_sad_epu8(va, vb);
+	int sum = _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+
+	return finishDistance(sum, a, b);
+}
+
+__attribute__((target("sse2")))
+static void distance4SSE2(const Face *const a[4], const Face *const b[4], int out[4])
+{
+	for (int i = 0; i < 4; ++i)
+		out[i] = distanceSSE2(*a[i], *b[i]);
+}
+
+static const FaceKernel s_kernel_sse2 = {
+	"sse2", distanceSSE2, distance4SSE2
+};
+
+// ============ AVX2: two face pairs per instruction ============
+
+__attribute__((target("avx2")))
+static inline __m256i load2(const Face *lo, const Face *hi)
+{
+	return _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo->colors)),
+		_mm_loadu_si128((const __m128i *)hi->colors), 1);
+}
+
+__attribute__((target("avx2")))
+static void distance4AVX2(const Face *const a[4], const Face *const b[4], int out[4])
+{
+	for (int i = 0; i < 4; i += 2) {
+		// 4x 64-bit partial sums: [pair i lo, pair i hi, pair i+1 lo, pair i+1 hi]
+		__m256i sad = _mm256_sad_epu8(load2(a[i], a[i + 1]), load2(b[i], b[i + 1]));
+		alignas(32) uint64_t sums[4];
+		_mm256_store_si256((__m256i *)sums, sad);
+
+		out[i]     = finishDistance(sums[0] + sums[1], *a[i],     *b[i]);
+		out[i + 1] = finishDistance(sums[2] + sums[3], *a[i + 1], *b[i + 1]);
+	}
+}
+
+static const FaceKernel s_kernel_avx2 = {
+	"avx2", distanceSSE2, distance4AVX2
+};
+
+// ============ AVX-512BW: four face pairs per instruction ============
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i load4(const Face *const f[4])
+{
+	__m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)f[0]->colors));
+	v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)f[1]->colors), 1);
+	v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)f[2]->colors), 2);
+	v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)f[3]->colors), 3);
+	return v;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void distance4AVX512(const Face *const a[4], const Face *const b[4], int out[4])
+{
+	__m512i sad = _mm512_sad_epu8(load4(a), load4(b));
+	alignas(64) uint64_t sums[8];
+	_mm512_store_si512((__m512i *)sums, sad);
+
+	for (int i = 0; i < 4; ++i)
+		out[i] = finishDistance(sums[i * 2] + sums[i * 2 + 1], *a[i], *b[i]);
+}
+
+static const FaceKernel s_kernel_avx512 = {
+	"avx512bw", distanceSSE2, distance4AVX512
+};
+#endif
+
+std::vector<const FaceKernel *> Face::getKernels()
+{
+	std::vector<const FaceKernel *> list;
+	list.push_back(&s_kernel_scalar);
+
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		list.push_back(&s_kernel_sse2);
+	if (__builtin_cpu_supports("avx2"))
+		list.push_back(&s_kernel_avx2);
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		list.push_back(&s_kernel_avx512);
+#endif
+	return list;
+}
+
+// Last entry = best supported
+const FaceKernel *Face::s_kernel = Face::getKernels().back();
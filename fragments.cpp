@@ -0,0 +1,219 @@
+#include "fragments.h"
+#include "puzzle.h"
+#include <unordered_set>
+
+void Fragments::init(TileStore &pool)
+{
+	size_t n = pool.size();
+	m_pool = &pool;
+
+	m_root.resize(n);
+	m_offset.assign(n, v2s32());
+	m_members.assign(n, std::vector<uint32_t>());
+	m_cells.assign(n, std::unordered_map<unsigned long long, uint32_t>());
+	m_stamp.resize(n);
+	m_last_stamp = 0;
+
+	m_journal.clear();
+	m_journal_marks.clear();
+
+	for (uint32_t i = 0; i < n; ++i) {
+		m_root[i] = i;
+		m_members[i].push_back(i);
+		m_cells[i][v2s32().getHash()] = i;
+		m_stamp[i] = ++m_last_stamp;
+	}
+}
+
+bool Fragments::merge(Tile *a, Tile *b, TILE_POS face)
+{
+	if (m_root[a->index] == m_root[b->index])
+		return m_offset[b->index] == m_offset[a->index] + tile_pos_to_dir[face];
+
+	Move m = getMove(a, b, face);
+	if (!checkMove(m))
+		return false;
+
+	applyMove(m);
+	return true;
+}
+
+bool Fragments::canMerge(const Tile *a, const Tile *b, TILE_POS face) const
+{
+	if (m_root[a->index] == m_root[b->index])
+		return m_offset[b->index] == m_offset[a->index] + tile_pos_to_dir[face];
+
+	return checkMove(getMove(a, b, face));
+}
+
+Fragments::Move Fragments::getMove(const Tile *a, const Tile *b, TILE_POS face) const
+{
+	uint32_t root_a = m_root[a->index];
+	uint32_t root_b = m_root[b->index];
+
+	// Translation from the fragment of "b" to the one of "a"
+	Move m { root_b, root_a,
+		m_offset[a->index] + tile_pos_to_dir[face] - m_offset[b->index] };
+	if (m_members[root_b].size() > m_members[root_a].size())
+		m = Move { root_a, root_b, v2s32() - m.delta };
+	return m;
+}
+
+bool Fragments::checkMove(const Move &m) const
+{
+	auto &cells = m_cells[m.to];
+	for (uint32_t i : m_members[m.from]) {
+		if (cells.find((m_offset[i] + m.delta).getHash()) != cells.end())
+			return false;
+	}
+	return true;
+}
+
+void Fragments::applyMove(const Move &m)
+{
+	if (!m_journal_marks.empty())
+		m_journal.push_back(Change { Change::MERGE, m, m_members[m.to].size(), {} });
+
+	auto &members = m_members[m.to];
+	auto &cells = m_cells[m.to];
+	for (uint32_t i : m_members[m.from]) {
+		m_root[i] = m.to;
+		m_offset[i] = m_offset[i] + m.delta;
+		members.push_back(i);
+		cells[m_offset[i].getHash()] = i;
+	}
+	m_members[m.from].clear();
+	m_cells[m.from].clear();
+	touch(m.from);
+	touch(m.to);
+}
+
+void Fragments::split(Tile *a, Tile *b)
+{
+	uint32_t root = m_root[a->index];
+	if (root != m_root[b->index])
+		return;
+
+	// The links changed in any case
+	touch(root);
+
+	// Collect the side of "b". Swap sides if it contains the root.
+	std::vector<uint32_t> side;
+	auto collect = [&] (Tile *start, Tile *other) -> bool {
+		side.clear();
+		side.push_back(start->index);
+		std::unordered_set<uint32_t> seen { start->index };
+
+		for (size_t n = 0; n < side.size(); ++n) {
+			Tile *tile = (*m_pool)[side[n]];
+			for (int i = 0; i < TP_TOTAL; ++i) {
+				Tile *next = tile->getNeighbour((TILE_POS)i);
+				if (!next || !seen.insert(next->index).second)
+					continue;
+
+				if (next == other)
+					return false; // still connected
+				side.push_back(next->index);
+			}
+		}
+		return true;
+	};
+
+	if (!collect(b, a))
+		return;
+
+	uint32_t new_root = b->index;
+	for (uint32_t i : side) {
+		if (i == root) {
+			collect(a, b);
+			new_root = a->index;
+			break;
+		}
+	}
+
+	// Move "side" out into its own fragment
+	v2s32 base = m_offset[new_root];
+	if (!m_journal_marks.empty()) {
+		m_journal.push_back(Change { Change::SPLIT,
+			Move { root, new_root, v2s32() - base }, 0, m_members[root] });
+	}
+
+	auto &old_cells = m_cells[root];
+	for (uint32_t i : side) {
+		old_cells.erase(m_offset[i].getHash());
+		m_root[i] = new_root;
+		m_offset[i] = m_offset[i] - base;
+		m_members[new_root].push_back(i);
+		m_cells[new_root][m_offset[i].getHash()] = i;
+	}
+	touch(new_root);
+
+	auto &old_members = m_members[root];
+	size_t n = 0;
+	for (uint32_t i : old_members) {
+		if (m_root[i] == root)
+			old_members[n++] = i;
+	}
+	old_members.resize(n);
+}
+
+void Fragments::begin()
+{
+	m_journal_marks.push_back(m_journal.size());
+}
+
+void Fragments::commit()
+{
+	if (m_journal_marks.empty())
+		ERROR("No change to commit");
+
+	m_journal_marks.pop_back();
+	if (m_journal_marks.empty())
+		m_journal.clear();
+}
+
+void Fragments::rollback()
+{
+	if (m_journal_marks.empty())
+		ERROR("No change to roll back");
+
+	size_t mark = m_journal_marks.back();
+	m_journal_marks.pop_back();
+
+	while (m_journal.size() > mark) {
+		undo(m_journal.back());
+		m_journal.pop_back();
+	}
+}
+
+void Fragments::undo(Change &c)
+{
+	const Move &m = c.move;
+	touch(m.from);
+	touch(m.to);
+
+	if (c.type == Change::MERGE) {
+		// Moved tiles were appended to the members of "to"
+		auto &members = m_members[m.to];
+		for (size_t n = c.n_members; n < members.size(); ++n) {
+			uint32_t i = members[n];
+			m_cells[m.to].erase(m_offset[i].getHash());
+			m_root[i] = m.from;
+			m_offset[i] = m_offset[i] - m.delta;
+			m_members[m.from].push_back(i);
+			m_cells[m.from][m_offset[i].getHash()] = i;
+		}
+		members.resize(c.n_members);
+		return;
+	}
+
+	// SPLIT: put the new fragment back into the old one
+	for (uint32_t i : m_members[m.to]) {
+		m_root[i] = m.from;
+		m_offset[i] = m_offset[i] - m.delta;
+		m_cells[m.from][m_offset[i].getHash()] = i;
+	}
+	m_members[m.to].clear();
+	m_cells[m.to].clear();
+	m_members[m.from] = std::move(c.members);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "tile.h"
+#include <unordered_map>
+
+// Groups of linked tiles ("fragments") and their relative placement.
+// Each tile stores its fragment root and its offset to the root, each root
+// the occupied cells of its fragment. A merge moves the smaller fragment
+// into the larger one, thus only the smaller one is checked for collisions.
+class Fragments {
+public:
+	// Every tile becomes its own fragment
+	void init(TileStore &pool);
+
+	// Places "b" next to "a" on the given face of "a" and merges both
+	// fragments. out: false if any tile would overlap (not planar)
+	bool merge(Tile *a, Tile *b, TILE_POS face);
+	// Same as merge, without changing anything. Safe to call concurrently.
+	bool canMerge(const Tile *a, const Tile *b, TILE_POS face) const;
+	// Call after unlinking "a" from "b". Splits the fragment when
+	// there is no other path between the two tiles.
+	void split(Tile *a, Tile *b);
+
+	// Undo log, driven by Tile::begin/commit/rollback
+	void begin();
+	void commit();
+	void rollback();
+
+	inline Tile *getRoot(const Tile *tile) const
+	{ return (*m_pool)[m_root[tile->index]]; }
+	inline const v2s32 &getOffset(const Tile *tile) const
+	{ return m_offset[tile->index]; }
+	inline size_t getSize(const Tile *tile) const
+	{ return m_members[m_root[tile->index]].size(); }
+	// Changes whenever the fragment of "tile" or any link within it changes.
+	// Unique across all fragments.
+	inline uint64_t getStamp(const Tile *tile) const
+	{ return m_stamp[m_root[tile->index]]; }
+
+	// Calls f(tile, face, other) for each pair of tiles that would touch
+	// after placing "b" next to "a", "a" and "b" included: "other" would be
+	// at "face" of "tile". Walks the smaller fragment only.
+	// out: false if the fragments cannot be merged (overlap or same one)
+	template<typename F>
+	bool forEachContact(const Tile *a, const Tile *b, TILE_POS face, F f) const;
+
+private:
+	struct Move {
+		uint32_t from, to; // roots
+		v2s32 delta;
+	};
+	// Smaller fragment into the larger one. Roots must differ.
+	Move getMove(const Tile *a, const Tile *b, TILE_POS face) const;
+	// out: false on collision
+	bool checkMove(const Move &m) const;
+	void applyMove(const Move &m);
+
+	struct Change {
+		enum {
+			MERGE, // move = merged fragments, n_members = old size of "to"
+			SPLIT  // move = old root -> new root, members = old members of root
+		} type;
+		Move move;
+		size_t n_members;
+		std::vector<uint32_t> members;
+	};
+	void undo(Change &c);
+	inline void touch(uint32_t root) { m_stamp[root] = ++m_last_stamp; }
+
+	std::vector<Change> m_journal;
+	std::vector<size_t> m_journal_marks;
+
+	TileStore *m_pool = nullptr;
+
+	// Per tile
+	std::vector<uint32_t> m_root;
+	std::vector<v2s32> m_offset;
+	// Per root, empty for other tiles
+	std::vector<std::vector<uint32_t>> m_members;
+	std::vector<std::unordered_map<unsigned long long, uint32_t>> m_cells;
+	std::vector<uint64_t> m_stamp;
+	uint64_t m_last_stamp = 0;
+};
+
+template<typename F>
+bool Fragments::forEachContact(const Tile *a, const Tile *b, TILE_POS face, F f) const
+{
+	if (m_root[a->index] == m_root[b->index])
+		return false;
+
+	Move m = getMove(a, b, face);
+	if (!checkMove(m))
+		return false;
+
+	auto &cells = m_cells[m.to];
+	for (uint32_t i : m_members[m.from]) {
+		v2s32 pos = m_offset[i] + m.delta;
+		for (int j = 0; j < TP_TOTAL; ++j) {
+			auto it = cells.find((pos + tile_pos_to_dir[j]).getHash());
+			if (it != cells.end())
+				f((*m_pool)[i], (TILE_POS)j, (*m_pool)[it->second]);
+		}
+	}
+	return true;
+}
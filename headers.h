@@ -5,8 +5,8 @@
 #include <iostream> // cout
 #include "vector.h"
 
-typedef Vector2D<int16_t> v2s16;
-typedef Vector2D<uint16_t> v2u16;
+typedef Vector2D<int32_t> v2s32;
+typedef Vector2D<uint32_t> v2u32;
 
 // Change to 1 for verbose logging
 #if 0
@@ -0,0 +1,91 @@
+#include "heapsolver.h"
+#include "puzzle.h"
+#include <queue>
+
+size_t HeapSolver::run(const Deadline &deadline)
+{
+	Timer t_("HeapSolver::run");
+	TileStore &pool = m_puzzle.pool;
+	const Fragments &fragments = m_puzzle.fragments;
+
+	std::vector<Edge> edges;
+	edges.reserve(pool.size() * TP_TOTAL);
+	for (Tile *t1 : pool) {
+		if (deadline.expired()) {
+			WARN("Time budget exceeded while collecting the links");
+			return 0;
+		}
+
+		for (int face = 0; face < TP_TOTAL; ++face) {
+			if (t1->getNeighbour((TILE_POS)face))
+				continue;
+
+			for (const Candidate &c : m_puzzle.candidates.get(t1, (TILE_POS)face)) {
+				edges.push_back(Edge { c.diff, t1->index, c.tile->index,
+					(TILE_POS)face, fragments.getStamp(t1), fragments.getStamp(c.tile) });
+			}
+		}
+	}
+
+	std::priority_queue<Edge, std::vector<Edge>, EdgeCompare> heap(
+		EdgeCompare(), std::move(edges));
+	size_t merged = 0;
+
+	while (!heap.empty()) {
+		// Links are only added, thus the current state is the best so far
+		if (deadline.expired()) {
+			WARN("Time budget exceeded, " << heap.size() << " links not evaluated");
+			break;
+		}
+
+		Edge e = heap.top();
+		heap.pop();
+
+		Tile *t1 = pool[e.t1],
+			*t2 = pool[e.t2];
+
+		// Stale: the faces are taken or the tiles are already connected
+		if (t1->getNeighbour(e.face) || t2->getNeighbour(swapTilePos(e.face)))
+			continue;
+		if (fragments.getRoot(t1) == fragments.getRoot(t2))
+			continue;
+
+		// Fragments changed since the key was computed: score again.
+		// Stamps are never reused, thus an outdated one cannot match.
+		uint64_t s1 = fragments.getStamp(t1),
+			s2 = fragments.getStamp(t2);
+		if (s1 != e.stamp1 || s2 != e.stamp2) {
+			int key = getMergeKey(t1, e.face, t2);
+			if (key < 0)
+				continue; // overlap
+
+			heap.push(Edge { key, e.t1, e.t2, e.face, s1, s2 });
+			continue;
+		}
+
+		if (!m_puzzle.mergeFragments(t1, e.face, t2))
+			continue;
+
+		merged++;
+		LOG(PP(t1->original_pos) << " <--> " << PP(t2->original_pos)
+			<< "  diff=" << e.key << ", face=" << (int)e.face);
+	}
+
+	LOG("Merged " << merged << " times, " << pool.size() - merged << " fragments left");
+	return merged;
+}
+
+int HeapSolver::getMergeKey(Tile *t1, TILE_POS face, Tile *t2) const
+{
+	int64_t sum = 0;
+	int64_t count = 0;
+	bool ok = m_puzzle.fragments.forEachContact(t1, t2, face,
+			[&] (Tile *a, TILE_POS a_face, Tile *b) {
+		sum += m_puzzle.getFaceDistance(a, a_face, b);
+		count++;
+	});
+
+	if (!ok || count == 0)
+		return -1;
+	return sum / count;
+}
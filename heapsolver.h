@@ -0,0 +1,48 @@
+#pragma once
+
+#include "tile.h"
+#include "util/timer.h"
+#include <vector>
+
+class Puzzle;
+
+// Kruskal-style greedy assembly in a single pass.
+// All candidate links go into one min-heap. The best one is accepted when
+// both fragments can be merged without overlap; then every pair of tiles
+// that touch after the merge gets linked as well. Entries of fragments that
+// changed since they were scored are re-scored lazily when they come up.
+class HeapSolver {
+public:
+	HeapSolver(Puzzle &puzzle) : m_puzzle(puzzle) {}
+
+	// Stops merging once "deadline" expired
+	// out: number of accepted merges
+	size_t run(const Deadline &deadline = Deadline());
+
+private:
+	struct Edge {
+		int key;
+		uint32_t t1, t2;
+		TILE_POS face; // of t1
+		// Fragments::getStamp of both tiles when "key" was computed
+		uint64_t stamp1, stamp2;
+	};
+	struct EdgeCompare {
+		// std::priority_queue pops the largest, thus inverted
+		bool operator()(const Edge &a, const Edge &b) const
+		{
+			if (a.key != b.key)
+				return a.key > b.key;
+			if (a.t1 != b.t1)
+				return a.t1 > b.t1;
+			if (a.face != b.face)
+				return a.face > b.face;
+			return a.t2 > b.t2;
+		}
+	};
+
+	// Mean distance of all contacts of the merge. -1 if not possible
+	int getMergeKey(Tile *t1, TILE_POS face, Tile *t2) const;
+
+	Puzzle &m_puzzle;
+};
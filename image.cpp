@@ -1,214 +1,523 @@
 #include "headers.h"
 #include "image.h"
-#include "tile.h"
+#include "puzzle.h"
+#include "util/parallel.h"
 #include "util/timer.h"
+#include <cstring>
 #include <fstream>
-#include <unordered_map>
+#include <unistd.h>
 
-Image::Image(const std::string &filepath)
+Image::Image(const std::string &filepath, const v2u32 &raw_size) :
+	m_filepath(filepath)
 {
-	// Open & check
-	{
-		m_file = fopen(filepath.c_str(), "rb");
+	if (!m_input.open(filepath))
+		ERROR("Cannot open/find file " << filepath);
+
+	const uint8_t *magic = m_input.data();
+	if (raw_size.X > 0 && raw_size.Y > 0)
+		openRaw(raw_size);
+	else if (m_input.size() >= 8 && !png_sig_cmp(magic, 0, 8))
+		openPNG();
+	else if (m_input.size() >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6'))
+		openPNM();
+	else
+		ERROR("Unknown image format: " << filepath);
 
-		if (!m_file)
-			ERROR("Cannot open/find file");
+	LOG("Loaded image " << filepath << std::endl
+		<< "\tSize:        " << PP(size) << std::endl
+		<< "\tFormat:      " << (m_png ? "PNG" : (m_image ? "PNM/raw" : "?")) << std::endl
+		<< "\tBytes/Pixel: " << m_bpp);
+}
 
-		uint8_t header[8];
-		if (fread(header, 1, 8, m_file) != 8 || png_sig_cmp(header, 0, 8))
-			ERROR("Not a PNG file");
-	}
+Image::~Image()
+{
+	closePNG();
+
+	free(m_canvas);
+}
 
+void Image::readPNGCallback(png_struct *png, png_byte *data, size_t length)
+{
+	Image *img = (Image *)png_get_io_ptr(png);
+	if (img->m_input_offset + length > img->m_input.size())
+		png_error(png, "Unexpected end of file");
+
+	memcpy(data, img->m_input.data() + img->m_input_offset, length);
+	img->m_input_offset += length;
+}
+
+void Image::openPNG()
+{
 	m_png  = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	m_info = png_create_info_struct(m_png);
 
 	if (setjmp(png_jmpbuf(m_png)))
 		ERROR("Cannot set scope to current routine");
 
-	png_init_io(m_png, m_file);
-	png_set_sig_bytes(m_png, 8); // Header already read
-	png_set_user_limits(m_png, 0xFFFF, 0xFFFF);
-	png_read_png(m_png, m_info,
-		PNG_TRANSFORM_STRIP_16 |
-		PNG_TRANSFORM_STRIP_ALPHA |
-		PNG_TRANSFORM_PACKING |
-		PNG_TRANSFORM_BGR, nullptr);
+	m_input_offset = 8;
+	png_set_read_fn(m_png, this, readPNGCallback);
+	png_set_sig_bytes(m_png, 8); // Header already checked
+	png_set_user_limits(m_png, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+	png_read_info(m_png, m_info);
+
+	// Same as PNG_TRANSFORM_STRIP_16 | STRIP_ALPHA | PACKING | BGR
+	png_set_strip_16(m_png);
+	png_set_strip_alpha(m_png);
+	png_set_packing(m_png);
+	png_set_bgr(m_png);
+	png_read_update_info(m_png, m_info);
 
 	this->size.X = png_get_image_width(m_png, m_info);
 	this->size.Y = png_get_image_height(m_png, m_info);
-
-	auto color_type = png_get_color_type(m_png, m_info);
 	m_bpp = png_get_rowbytes(m_png, m_info) / size.X;
-
-	LOG("Loaded image " << filepath << std::endl
-		<< "\tSize:        " << PP(size) << std::endl
-		<< "\tColor type:  " << (int)color_type << std::endl
-		<< "\tDepth:       " << (int)png_get_bit_depth(m_png, m_info) << std::endl
-		<< "\tBytes/Pixel: " << m_bpp);
+	m_bgr = true;
+	m_sample_channel = 0;
 }
 
-Image::~Image()
+void Image::closePNG()
 {
-	png_destroy_read_struct(&m_png, &m_info, nullptr);
-	fclose(m_file);
+	if (m_png)
+		png_destroy_read_struct(&m_png, &m_info, nullptr);
 	m_png = nullptr;
 	m_info = nullptr;
-	m_file = nullptr;
+}
 
-	if (m_output) {
-		for (int y = 0; y < size.Y; ++y)
-			delete[] m_output[y];
+void Image::openPNM()
+{
+	const uint8_t *data = m_input.data();
+	size_t length = m_input.size();
+	size_t pos = 2;
+
+	// Header: magic, width, height, maxval, each separated by whitespace.
+	// Comments start with '#' and end at the line end.
+	auto f_number = [&] () -> long {
+		while (pos < length) {
+			if (data[pos] == '#') {
+				while (pos < length && data[pos] != '\n')
+					pos++;
+			} else if (isspace(data[pos])) {
+				pos++;
+			} else {
+				break;
+			}
+		}
+
+		long value = 0;
+		size_t start = pos;
+		while (pos < length && isdigit(data[pos]) && value <= INT32_MAX)
+			value = value * 10 + (data[pos++] - '0');
+		if (pos == start)
+			ERROR("Broken PNM header");
+		return value;
+	};
 
-		delete[] m_output;
+	long width = f_number(),
+		height = f_number(),
+		maxval = f_number();
+	pos++; // single whitespace before the pixels
+
+	if (width <= 0 || height <= 0 || width > INT32_MAX || height > INT32_MAX)
+		ERROR("Unsupported image size " << width << "x" << height);
+	if (maxval <= 0)
+		ERROR("Invalid PNM maxval " << maxval);
+	if (maxval > 255)
+		ERROR("16-bit PNM files are not supported");
+
+	size = v2u32(width, height);
+	m_bpp = data[1] == '5' ? 1 : 3;
+	m_bgr = false;
+	m_sample_channel = m_bpp == 3 ? 2 : 0;
+
+	size_t bytes = (size_t)width * height * m_bpp;
+	if (pos + bytes > length)
+		ERROR("Truncated PNM file");
+
+	const uint8_t *pixels = m_input.data() + pos;
+	if (maxval < 255) {
+		// Scale to 0..255. Values above maxval are invalid, thus clamped.
+		m_pixels.resize(bytes);
+		for (size_t i = 0; i < bytes; ++i) {
+			long value = std::min<long>(pixels[i], maxval);
+			m_pixels[i] = (value * 255 + maxval / 2) / maxval;
+		}
+		pixels = m_pixels.data();
 	}
+
+	m_rows.resize(size.Y);
+	for (uint32_t y = 0; y < size.Y; ++y)
+		m_rows[y] = pixels + (size_t)y * width * m_bpp;
+	m_image = m_rows.data();
 }
 
-void Image::read(const v2u16 &n_tiles)
+void Image::openRaw(const v2u32 &raw_size)
 {
+	size = raw_size;
+	m_bpp = 3;
+	m_bgr = false;
+	m_sample_channel = 2;
+
+	if ((size_t)size.X * size.Y * m_bpp > m_input.size())
+		ERROR("Raw input is smaller than " << size.X << "x" << size.Y << " RGB");
+
+	m_rows.resize(size.Y);
+	for (uint32_t y = 0; y < size.Y; ++y)
+		m_rows[y] = m_input.data() + (size_t)y * size.X * m_bpp;
+	m_image = m_rows.data();
+}
+
+void Image::loadPixels()
+{
+	if (m_image)
+		return;
+
+	// The previous read consumed the rows already
+	if (!m_png) {
+		openPNG();
+	}
+
+	Timer t_("Image::loadPixels");
 	if (setjmp(png_jmpbuf(m_png)))
 		ERROR("Cannot set scope to current routine");
 
-	if (m_output) {
-		for (int y = 0; y < size.Y; ++y)
-			delete[] m_output[y];
+	size_t bytes_per_row = png_get_rowbytes(m_png, m_info);
+	m_pixels.resize(bytes_per_row * size.Y);
+	std::vector<uint8_t *> rows(size.Y);
+	for (uint32_t y = 0; y < size.Y; ++y)
+		rows[y] = &m_pixels[bytes_per_row * y];
+
+	png_set_interlace_handling(m_png);
+	png_read_image(m_png, rows.data());
+	png_read_end(m_png, nullptr);
+	m_rows.assign(rows.begin(), rows.end());
+	m_image = m_rows.data();
+}
 
-		delete[] m_output;
+void Image::copyPixels()
+{
+	loadPixels();
+	if (!m_pixels.empty())
+		return;
+
+	// Mapped input or spilled PNG
+	size_t bytes_per_row = (size_t)size.X * m_bpp;
+	m_pixels.resize(bytes_per_row * size.Y);
+	for (uint32_t y = 0; y < size.Y; ++y) {
+		memcpy(&m_pixels[bytes_per_row * y], m_image[y], bytes_per_row);
+		m_rows[y] = &m_pixels[bytes_per_row * y];
 	}
-	g_pool.clear();
+	m_image = m_rows.data();
+}
 
-	Timer t_("Image::read");
-	g_pool.reserve(n_tiles.X * n_tiles.Y);
-	m_output = new uint8_t*[size.Y * DBG_SCALE];
+void Image::spillPixels()
+{
+	if (m_image)
+		return;
 
-	// Reading
-	{
-		size_t bytes_per_row = png_get_rowbytes(m_png, m_info);
-		LOG("Bytes per row: " << bytes_per_row);
+	if (!m_png)
+		openPNG();
 
-		m_image = png_get_rows(m_png, m_info);
+	if (png_get_interlace_type(m_png, m_info) != PNG_INTERLACE_NONE) {
+		WARN("Cannot stream this image. Decoding it entirely.");
+		loadPixels();
+		return;
+	}
 
-		// Copy
-		for (int y = 0; y < size.Y * DBG_SCALE; ++y){
-			m_output[y] = new uint8_t[bytes_per_row * DBG_SCALE];
-			for (size_t x = 0; x < bytes_per_row * DBG_SCALE; ++x)
-				m_output[y][x] = 0x22;
-		}
+	Timer t_("Image::spillPixels");
+	const char *dir = getenv("TMPDIR");
+	std::string path = std::string(dir && *dir ? dir : "/tmp") + "/earthstar_XXXXXX";
+	int fd = mkstemp(&path[0]);
+	FILE *file = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+	if (!file)
+		ERROR("Cannot create a temporary file in " << path);
+
+	if (setjmp(png_jmpbuf(m_png)))
+		ERROR("Cannot set scope to current routine");
+
+	size_t bytes_per_row = png_get_rowbytes(m_png, m_info);
+	std::vector<uint8_t> buffer(bytes_per_row);
+	for (uint32_t y = 0; y < size.Y; ++y) {
+		png_read_row(m_png, buffer.data(), nullptr);
+		if (fwrite(buffer.data(), 1, bytes_per_row, file) != bytes_per_row)
+			ERROR("Cannot write " << path);
 	}
-	
+	png_read_end(m_png, nullptr);
+
+	bool ok = fclose(file) == 0 && m_spill.open(path);
+	unlink(path.c_str()); // Stays mapped until closed
+	if (!ok)
+		ERROR("Cannot map " << path);
+
+	m_rows.resize(size.Y);
+	for (uint32_t y = 0; y < size.Y; ++y)
+		m_rows[y] = m_spill.data() + bytes_per_row * y;
+	m_image = m_rows.data();
+}
+
+void Image::prepareCanvas(uint32_t width, uint32_t height, bool clear)
+{
+	// Align each row for faster copies
+	size_t stride = ((size_t)width * m_bpp + 63) & ~(size_t)63;
+	size_t bytes = stride * height;
+
+	if (bytes > m_canvas_bytes) {
+		free(m_canvas);
+		m_canvas = (uint8_t *)aligned_alloc(64, bytes);
+		if (!m_canvas)
+			ERROR("Out of memory");
+		m_canvas_bytes = bytes;
+		clear = true;
+	} else if (stride != m_canvas_stride || height != m_canvas_height) {
+		clear = true;
+	}
+
+	m_canvas_stride = stride;
+	m_canvas_width = width;
+	m_canvas_height = height;
+
+	if (clear)
+		memset(m_canvas, 0x22, bytes);
+}
+
+void Image::read(Puzzle &puzzle, const v2u32 &n_tiles, bool stream)
+{
+	puzzle.compat.clear();
+	puzzle.candidates.clear();
+	puzzle.mapdata.clear();
+
+	Timer t_("Image::read");
+	if ((uint64_t)n_tiles.X * n_tiles.Y >= TILE_NONE)
+		ERROR("Too many tiles: " << PP(n_tiles));
+	puzzle.pool.reset(n_tiles.X * n_tiles.Y);
+
 	// Parse it!
-	m_tilesize = size / n_tiles;
+	setTileCount(n_tiles);
 	LOG("Reading " << PP(n_tiles) << " tiles, tilesize=" << PP(m_tilesize));
 
-	// Map to find other tiles easily
-	std::unordered_map<uint32_t, Tile *> tiles;
-	tiles.reserve(n_tiles.X * n_tiles.Y);
+	if (stream && (m_image || (m_png
+			&& png_get_interlace_type(m_png, m_info) == PNG_INTERLACE_NONE))) {
+		readStreamed(puzzle, n_tiles);
+		puzzle.fragments.init(puzzle.pool);
+		return;
+	}
+	if (stream)
+		WARN("Cannot stream this image. Decoding it entirely.");
+
+	// Reading
+	loadPixels();
+	if (m_integral.empty())
+		buildIntegral();
+
+	v2u32 total_segs = n_tiles * SEGNUM;
+	v2u32 seg_size = size / total_segs;
+	v2u32 window = m_tilesize / SEGNUM;
+
+	// Dense grid: tile (x, y) has the index y * n_tiles.X + x
+	for (uint32_t y = 0; y < n_tiles.Y; ++y)
+	for (uint32_t x = 0; x < n_tiles.X; ++x)
+		puzzle.pool.add(seg_size * v2u32(x * SEGNUM, y * SEGNUM));
+
+	TileStore &pool = puzzle.pool;
+	parallelFor(n_tiles.Y, [&] (size_t y) {
+		for (uint32_t x = 0; x < n_tiles.X; ++x) {
+			uint32_t index = y * n_tiles.X + x;
+			v2u32 origin = pool[index]->original_pos;
+
+			// Border segments only
+			for (uint32_t i = 0; i < SEGNUM; ++i) {
+				v2u32 top = origin + seg_size * v2u32(i, 0),
+					bottom = origin + seg_size * v2u32(i, SEGNUM - 1),
+					left = origin + seg_size * v2u32(0, i),
+					right = origin + seg_size * v2u32(SEGNUM - 1, i);
+
+				pool.getColors(index, TP_TOP)[i] = getAverage(top, top + window);
+				pool.getColors(index, TP_BOTTOM)[i] = getAverage(bottom, bottom + window);
+				pool.getColors(index, TP_LEFT)[i] = getAverage(left, left + window);
+				pool.getColors(index, TP_RIGHT)[i] = getAverage(right, right + window);
+			}
+			pool.updateVariance(index);
+		}
+	});
+
+	puzzle.fragments.init(puzzle.pool);
+}
 
-	v2u16 total_segs = n_tiles * SEGNUM;
+void Image::setTileCount(const v2u32 &n_tiles)
+{
+	m_blurred.clear();
+	m_n_tiles = n_tiles;
+	m_tilesize = size / n_tiles;
+}
 
-	Tile *tile;
-	for (int y = 0; y < total_segs.Y; ++y)
-	for (int x = 0; x < total_segs.X; ++x) {
-		v2u16 seg_pos(x & (SEGNUM - 1), y & (SEGNUM - 1));
-		// Faces for X and Y: "Edge"/Corner cases
-		Vector2D<uint8_t> facenum(TP_TOTAL, TP_TOTAL);
+void Image::readStreamed(Puzzle &puzzle, const v2u32 &n_tiles)
+{
+	if (m_png && setjmp(png_jmpbuf(m_png)))
+		ERROR("Cannot set scope to current routine");
 
-		if (seg_pos.Y == 0)
-			facenum.X = TP_TOP;
-		else if (seg_pos.Y == (SEGNUM - 1))
-			facenum.X = TP_BOTTOM;
+	v2u32 total_segs = n_tiles * SEGNUM;
+	v2u32 seg_size = size / total_segs;
+	v2u32 window = m_tilesize / SEGNUM;
 
-		if (seg_pos.X == 0)
-			facenum.Y = TP_LEFT;
-		else if (seg_pos.X == (SEGNUM - 1))
-			facenum.Y = TP_RIGHT;
+	// Same order and positions as the non-streamed read
+	for (uint32_t y = 0; y < n_tiles.Y; ++y)
+	for (uint32_t x = 0; x < n_tiles.X; ++x)
+		puzzle.pool.add(seg_size * v2u32(x * SEGNUM, y * SEGNUM));
 
-		// Ignore center segments
-		if (facenum == Vector2D<uint8_t>(TP_TOTAL, TP_TOTAL))
-			continue;
+	// Rows come from the decoder or straight from the mapped input
+	std::vector<uint8_t> buffer;
+	if (!m_image)
+		buffer.resize(png_get_rowbytes(m_png, m_info));
 
-		v2u16 tile_pos(x / SEGNUM, y / SEGNUM);
-		v2u16 image_pos = size / total_segs * v2u16(x, y);
+	// Sums of the current segment row
+	std::vector<uint64_t> sums(total_segs.X, 0);
 
-		// Get or create new
-		auto it = tiles.find(tile_pos.getHash());
-		if (it != tiles.end()) {
-			tile = it->second;
+	for (uint32_t y = 0; y < size.Y; ++y) {
+		const uint8_t *row;
+		if (m_image) {
+			row = m_image[y];
 		} else {
-			tile = new Tile(tile_pos, image_pos);
-			tiles[tile_pos.getHash()] = tile;
-			VERBOSE("Add tile " << tile_pos.getHash());
-			g_pool.push_back(tile);
+			png_read_row(m_png, buffer.data(), nullptr);
+			row = buffer.data();
+		}
+
+		uint32_t sy = y / seg_size.Y;
+		if (sy >= total_segs.Y)
+			continue; // remainder
+		uint32_t in_seg = y - sy * seg_size.Y;
+		if (in_seg >= window.Y)
+			continue;
+
+		// Only the border segments of each tile are of interest
+		uint32_t seg_pos_y = sy & (SEGNUM - 1);
+		bool full_row = seg_pos_y == 0 || seg_pos_y == SEGNUM - 1;
+
+		for (uint32_t sx = 0; sx < total_segs.X; ++sx) {
+			uint32_t seg_pos_x = sx & (SEGNUM - 1);
+			if (!full_row && seg_pos_x != 0 && seg_pos_x != SEGNUM - 1)
+				continue;
+
+			size_t start = (size_t)sx * seg_size.X;
+			size_t end = std::min<size_t>(start + window.X, size.X);
+			uint64_t sum = 0;
+			for (size_t x = start; x < end; ++x)
+				sum += row[x * m_bpp + m_sample_channel];
+			sums[sx] += sum;
 		}
 
-		uint8_t avg = getAverage(image_pos, image_pos + m_tilesize / SEGNUM);
+		// Last row of this segment row: store the averages
+		if (in_seg + 1 != window.Y && y + 1 != size.Y)
+			continue;
 
-		VERBOSE(PP(image_pos) << " avg=" << (int)avg << std::endl
-			<< "\tfaceX=" << (int)facenum.X
-			<< "\tfaceY=" << (int)facenum.Y
-			<< "\tSegm =" << PP(seg_pos));
+		uint64_t height = in_seg + 1;
+		for (uint32_t sx = 0; sx < total_segs.X; ++sx) {
+			uint32_t seg_pos_x = sx & (SEGNUM - 1);
+			if (!full_row && seg_pos_x != 0 && seg_pos_x != SEGNUM - 1)
+				continue;
+
+			size_t start = (size_t)sx * seg_size.X;
+			size_t width = std::min<size_t>(start + window.X, size.X) - start;
+			uint8_t avg = 0;
+			if (width > 0)
+				avg = (sums[sx] + 1) / (width * height);
+			sums[sx] = 0;
+
+			uint32_t index = (sy / SEGNUM) * n_tiles.X + sx / SEGNUM;
+			if (seg_pos_y == 0)
+				puzzle.pool.getColors(index, TP_TOP)[seg_pos_x] = avg;
+			else if (seg_pos_y == SEGNUM - 1)
+				puzzle.pool.getColors(index, TP_BOTTOM)[seg_pos_x] = avg;
+
+			if (seg_pos_x == 0)
+				puzzle.pool.getColors(index, TP_LEFT)[seg_pos_y] = avg;
+			else if (seg_pos_x == SEGNUM - 1)
+				puzzle.pool.getColors(index, TP_RIGHT)[seg_pos_y] = avg;
+		}
 
-		if (facenum.X != TP_TOTAL)
-			tile->faces[facenum.X].colors[seg_pos.X] = avg;
-		if (facenum.Y != TP_TOTAL)
-			tile->faces[facenum.Y].colors[seg_pos.Y] = avg;
+		// Tile row complete
+		if (seg_pos_y == SEGNUM - 1) {
+			uint32_t first = (sy / SEGNUM) * n_tiles.X;
+			for (uint32_t x = 0; x < n_tiles.X; ++x)
+				puzzle.pool.updateVariance(first + x);
+		}
 	}
 
-	if (g_pool.size() != (size_t)n_tiles.X * n_tiles.Y)
-		ERROR("Image parser is broken");
+	// The rows are gone. Decode again when plotting.
+	if (!m_image)
+		closePNG();
 }
 
-void Image::smoothen()
+int Image::getColorType() const
 {
-	for (Tile *tile : g_pool) {
-		for (int i = 0; i < TP_TOTAL; ++i) {
-			uint8_t min = 0xFF, max = 0;
+	// The canvas always holds 8 bits per sample, alpha is stripped on read
+	if (m_bpp == 2)
+		return PNG_COLOR_TYPE_GRAY_ALPHA;
+	if (m_bpp == 3)
+		return PNG_COLOR_TYPE_RGB;
+	if (m_bpp == 4)
+		return PNG_COLOR_TYPE_RGB_ALPHA;
+	return PNG_COLOR_TYPE_GRAY;
+}
 
-			uint8_t *colors = tile->faces[i].colors;
+png_struct *Image::beginPNG(FILE *file, png_info **info,
+		uint32_t width, uint32_t height)
+{
+	png_struct *png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	*info = png_create_info_struct(png);
 
-			for (int j = 0; j < SEGNUM; ++j) {
-				if (colors[j] < min)
-					min = colors[j];
-				if (colors[j] > max)
-					max = colors[j];
-			}
+	if (setjmp(png_jmpbuf(png)))
+		ERROR("Cannot set scope to current routine");
 
-			tile->faces[i].variance = max - min;
-		}
-	}
+	png_init_io(png, file);
+	png_set_IHDR(
+		png,
+		*info,
+		width,
+		height,
+		8,
+		getColorType(),
+		PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT
+	);
+
+	if (save_options.level >= 0)
+		png_set_compression_level(png, save_options.level);
+	if (save_options.filter >= 0)
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE << save_options.filter);
+
+	png_write_info(png, *info);
+	if (m_bgr)
+		png_set_bgr(png); // same memory layout as read
+	return png;
 }
 
 void Image::save(const std::string &filepath)
 {
+	Timer t_("Image::save");
 	FILE *file = fopen(filepath.c_str(), "wb");
 
 	if (!file)
 		ERROR("Cannot upen file");
 
-	png_struct *png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_info  *info = png_create_info_struct(m_png);
+	if (!m_canvas)
+		prepareCanvas(size.X, size.Y, true);
 
+	// Empty canvas: there would be no band to end the stream
+	if (save_options.parallel && m_canvas_width > 0 && m_canvas_height > 0) {
+		writeParallelIDAT(file, getColorType());
+		fclose(file);
+		return;
+	}
+
+	png_info *info;
+	png_struct *png = beginPNG(file, &info, m_canvas_width, m_canvas_height);
 	if (setjmp(png_jmpbuf(png)))
 		ERROR("Cannot set scope to current routine");
 
-	png_init_io(png, file);
-	// "Long-hand" for modifying the now hidden properies "width" and "height"
-	// Direct access works in libpng 1.2.x, but not 1.6.x
-	//m_info->width = size.X * DBG_SCALE;
-	//m_info->height = size.Y * DBG_SCALE;
-	png_set_IHDR(
-		png,
-		info,
-		size.X * DBG_SCALE,
-		size.Y * DBG_SCALE,
-		png_get_bit_depth(m_png, m_info),
-		png_get_color_type(m_png, m_info),
-		png_get_interlace_type(m_png, m_info),
-		png_get_compression_type(m_png, m_info),
-		png_get_filter_type(m_png, m_info)
-	);
+	std::vector<uint8_t *> rows(m_canvas_height);
+	for (uint32_t y = 0; y < m_canvas_height; ++y)
+		rows[y] = getCanvasRow(y);
 
-	png_write_info(png, info);
-	png_write_image(png, m_output);
+	png_write_image(png, rows.data());
 	png_write_end(png, nullptr);
 
 	fclose(file);
@@ -216,7 +525,208 @@ void Image::save(const std::string &filepath)
 	png_destroy_write_struct(&png, &info);
 }
 
-uint8_t Image::getAverage(const v2u16 &start, v2u16 end)
+static void writeChunk(FILE *file, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t head[8] = {
+		(uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len,
+		(uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3]
+	};
+	uLong crc = crc32(0, head + 4, 4);
+	if (len > 0)
+		crc = crc32(crc, data, len); // resets on nullptr
+	uint8_t tail[4] = {
+		(uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc
+	};
+
+	fwrite(head, 1, 8, file);
+	if (len > 0) // IEND has no data
+		fwrite(data, 1, len, file);
+	fwrite(tail, 1, 4, file);
+}
+
+static inline uint8_t paethPredictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = ABS(p - a), pb = ABS(p - b), pc = ABS(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Writes the filter type byte followed by the filtered row to "out".
+// "prev" is the unfiltered row above, or all zero for the first row.
+static void filterRow(int type, const uint8_t *row, const uint8_t *prev,
+		size_t len, int bpp, uint8_t *out)
+{
+	*out++ = type;
+	for (size_t i = 0; i < len; ++i) {
+		int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+		int b = prev[i];
+		int c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+
+		switch (type) {
+		case PNG_FILTER_VALUE_NONE:  out[i] = row[i]; break;
+		case PNG_FILTER_VALUE_SUB:   out[i] = row[i] - a; break;
+		case PNG_FILTER_VALUE_UP:    out[i] = row[i] - b; break;
+		case PNG_FILTER_VALUE_AVG:   out[i] = row[i] - ((a + b) >> 1); break;
+		case PNG_FILTER_VALUE_PAETH: out[i] = row[i] - paethPredictor(a, b, c); break;
+		}
+	}
+}
+
+void Image::writeParallelIDAT(FILE *file, int color_type)
+{
+	// Fixed band size: the output does not depend on the number of cores
+	const size_t BAND_BYTES = 256 * 1024;
+
+	size_t row_bytes = (size_t)m_canvas_width * m_bpp;
+	size_t rows_per_band = std::max<size_t>(1, BAND_BYTES / row_bytes);
+	size_t n_bands = (m_canvas_height + rows_per_band - 1) / rows_per_band;
+	int level = save_options.level >= 0 ? save_options.level : Z_DEFAULT_COMPRESSION;
+
+	struct Band {
+		std::vector<uint8_t> data;
+		uLong adler;
+		size_t raw_size;
+	};
+	std::vector<Band> bands(n_bands);
+	std::vector<uint8_t> zero_row(row_bytes, 0);
+
+	parallelFor(n_bands, [&] (size_t n) {
+		size_t y_start = n * rows_per_band;
+		size_t y_end = std::min<size_t>(y_start + rows_per_band, m_canvas_height);
+
+		// BGR to RGB if needed, then filter
+		std::vector<uint8_t> rgb[2];
+		rgb[0].resize(row_bytes);
+		rgb[1].resize(row_bytes);
+		auto f_load = [&] (size_t y, std::vector<uint8_t> &out) {
+			memcpy(out.data(), getCanvasRow(y), row_bytes);
+			if (m_bgr && m_bpp >= 3) {
+				for (size_t x = 0; x < row_bytes; x += m_bpp)
+					std::swap(out[x], out[x + 2]);
+			}
+		};
+
+		std::vector<uint8_t> raw((y_end - y_start) * (row_bytes + 1));
+		std::vector<uint8_t> trial(row_bytes + 1);
+		if (y_start > 0)
+			f_load(y_start - 1, rgb[1]);
+		else
+			rgb[1] = zero_row;
+
+		for (size_t y = y_start; y < y_end; ++y) {
+			std::vector<uint8_t> &cur = rgb[y & 1], &prev = rgb[(y + 1) & 1];
+			f_load(y, cur);
+			uint8_t *out = &raw[(y - y_start) * (row_bytes + 1)];
+
+			if (save_options.filter >= 0) {
+				filterRow(save_options.filter, cur.data(), prev.data(),
+					row_bytes, m_bpp, out);
+				continue;
+			}
+
+			// Minimal sum of absolute differences, like libpng
+			size_t best_sum = SIZE_MAX;
+			for (int type = 0; type < PNG_FILTER_VALUE_LAST; ++type) {
+				filterRow(type, cur.data(), prev.data(), row_bytes, m_bpp,
+					trial.data());
+				size_t sum = 0;
+				for (size_t i = 1; i <= row_bytes; ++i)
+					sum += ABS((int8_t)trial[i]);
+				if (sum < best_sum) {
+					best_sum = sum;
+					memcpy(out, trial.data(), row_bytes + 1);
+				}
+			}
+		}
+
+		// Raw deflate. All but the last band end byte-aligned (sync flush),
+		// so that the bands can be concatenated.
+		Band &band = bands[n];
+		band.raw_size = raw.size();
+		band.adler = adler32(1, raw.data(), raw.size());
+
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			ERROR("deflateInit2 failed");
+
+		band.data.resize(deflateBound(&zs, raw.size()) + 16);
+		zs.next_in = raw.data();
+		zs.avail_in = raw.size();
+		zs.next_out = band.data.data();
+		zs.avail_out = band.data.size();
+
+		int status = deflate(&zs, n + 1 == n_bands ? Z_FINISH : Z_SYNC_FLUSH);
+		if (status == Z_STREAM_ERROR || zs.avail_in != 0)
+			ERROR("deflate failed");
+
+		band.data.resize(zs.total_out);
+		deflateEnd(&zs);
+	});
+
+	// Header chunks
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	fwrite(signature, 1, 8, file);
+
+	uint8_t ihdr[13] = {
+		(uint8_t)(m_canvas_width >> 24), (uint8_t)(m_canvas_width >> 16),
+		(uint8_t)(m_canvas_width >> 8), (uint8_t)m_canvas_width,
+		(uint8_t)(m_canvas_height >> 24), (uint8_t)(m_canvas_height >> 16),
+		(uint8_t)(m_canvas_height >> 8), (uint8_t)m_canvas_height,
+		8, (uint8_t)color_type, 0, 0, 0
+	};
+	writeChunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+	// zlib header, see RFC 1950
+	int flevel = 2;
+	if (level >= 0 && level <= 1)
+		flevel = 0;
+	else if (level >= 2 && level <= 5)
+		flevel = 1;
+	else if (level >= 7)
+		flevel = 3;
+	uint8_t zhead[2] = { 0x78, (uint8_t)(flevel << 6) };
+	zhead[1] += 31 - ((zhead[0] << 8) | zhead[1]) % 31;
+	writeChunk(file, "IDAT", zhead, 2);
+
+	uLong adler = adler32(0, nullptr, 0);
+	for (Band &band : bands) {
+		writeChunk(file, "IDAT", band.data.data(), band.data.size());
+		adler = adler32_combine(adler, band.adler, band.raw_size);
+	}
+
+	uint8_t ztail[4] = {
+		(uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler
+	};
+	writeChunk(file, "IDAT", ztail, 4);
+	writeChunk(file, "IEND", nullptr, 0);
+}
+
+void Image::buildIntegral()
+{
+	Timer t_("Image::buildIntegral");
+	size_t stride = size.X + 1;
+
+	std::vector<uint32_t> &sat = m_integral;
+	sat.assign(stride * (size.Y + 1), 0);
+
+	// sat(x + 1, y + 1) = sum of all pixels in [0, x] x [0, y]
+	for (uint32_t y = 0; y < size.Y; ++y) {
+		const uint8_t *row = m_image[y] + m_sample_channel;
+		const uint32_t *above = &sat[y * stride];
+		uint32_t *line = &sat[(y + 1) * stride];
+
+		uint32_t row_sum = 0;
+		for (uint32_t x = 0; x < size.X; ++x) {
+			row_sum += row[(size_t)x * m_bpp];
+			line[x + 1] = above[x + 1] + row_sum;
+		}
+	}
+}
+
+uint8_t Image::getAverage(const v2u32 &start, v2u32 end)
 {
 	if (end.X > size.X)
 		end.X = size.X;
@@ -224,83 +734,204 @@ uint8_t Image::getAverage(const v2u16 &start, v2u16 end)
 	if (end.Y > size.Y)
 		end.Y = size.Y;
 
-	v2u16 diff = end - start;
+	v2u32 diff = end - start;
 
-	if (diff.X + diff.Y == 0)
+	if (diff.X == 0 || diff.Y == 0)
 		return 0;
 
-	uint64_t avg = 0;
-	for (int y = start.Y; y < end.Y; ++y) {
-		uint8_t *row = m_image[y];
-		for (int x = start.X; x < end.X; ++x) {
-			avg += row[x * m_bpp]; // R
-		}
+	const std::vector<uint32_t> &sat = m_integral;
+	size_t stride = size.X + 1;
+	uint32_t sum = sat[end.Y * stride + end.X]
+		- sat[start.Y * stride + end.X]
+		- sat[end.Y * stride + start.X]
+		+ sat[start.Y * stride + start.X];
+
+	return ((uint64_t)sum + 1) / ((uint64_t)diff.X * diff.Y);
+}
+
+void Image::renderBlur()
+{
+	if (!m_blurred.empty())
+		return;
+
+	Timer t_("Image::renderBlur");
+	loadPixels();
+	if (m_integral.empty())
+		buildIntegral();
+
+	size_t bytes_per_row = (size_t)size.X * m_bpp;
+	m_blurred.resize(bytes_per_row * size.Y);
+	m_blurred_rows.resize(size.Y);
+	for (uint32_t y = 0; y < size.Y; ++y) {
+		m_blurred_rows[y] = &m_blurred[bytes_per_row * y];
+		memcpy(m_blurred_rows[y], m_image[y], bytes_per_row);
 	}
 
-	avg = (avg + 1) / ((uint64_t)diff.X * diff.Y);
-
-#ifdef DBG_BLUR
-	for (int y = start.Y; y < end.Y; ++y) {
-		uint8_t *row = m_image[y];
-		for (int x = start.X; x < end.X; ++x) {
-			row[x * m_bpp + 0] = avg;
-			row[x * m_bpp + 1] = avg;
-			row[x * m_bpp + 2] = avg;
-			if (m_bpp == 4)
-				row[x * m_bpp + 3] = 0xFF;
+	v2u32 total_segs = m_n_tiles * SEGNUM;
+	for (uint32_t sy = 0; sy < total_segs.Y; ++sy)
+	for (uint32_t sx = 0; sx < total_segs.X; ++sx) {
+		uint32_t seg_x = sx & (SEGNUM - 1),
+			seg_y = sy & (SEGNUM - 1);
+		if (seg_x != 0 && seg_x != SEGNUM - 1
+				&& seg_y != 0 && seg_y != SEGNUM - 1)
+			continue;
+
+		v2u32 start = size / total_segs * v2u32(sx, sy);
+		v2u32 end = start + m_tilesize / SEGNUM;
+		uint8_t avg = getAverage(start, end);
+
+		end.X = std::min(end.X, size.X);
+		end.Y = std::min(end.Y, size.Y);
+		for (uint32_t y = start.Y; y < end.Y; ++y) {
+			uint8_t *row = m_blurred_rows[y];
+			memset(row + start.X * m_bpp, avg, (end.X - start.X) * m_bpp);
 		}
 	}
-#endif
-
-	return avg;
 }
 
 void Image::debugColorize(Tile *tile, uint8_t color, bool source)
 {
-	for (int y = 0; y < m_tilesize.Y; ++y) {
-		uint8_t *row  = (source ? m_image : m_output)[tile->original_pos.Y + y];
-		for (int x = 0; x < m_tilesize.X * m_bpp; ++x) {
-			row[tile->original_pos.X * m_bpp + x] = color;
-		}
+	if (source)
+		copyPixels();
+	else
+		loadPixels();
+	if (!m_canvas)
+		prepareCanvas(size.X, size.Y, true);
+
+	const v2u32 &pos = tile->original_pos;
+	for (uint32_t y = 0; y < m_tilesize.Y; ++y) {
+		if (!source && pos.Y + y >= m_canvas_height)
+			break;
+
+		uint8_t *row = source ? &m_pixels[(size_t)(pos.Y + y) * size.X * m_bpp]
+			: getCanvasRow(pos.Y + y);
+		int64_t width = m_tilesize.X;
+		if (!source)
+			width = std::min<int64_t>(width, (int64_t)m_canvas_width - pos.X);
+		if (width > 0)
+			memset(row + (size_t)pos.X * m_bpp, color, width * m_bpp);
 	}
 }
 
-void Image::plotTile(Tile *start_tile, bool clear)
+void Image::plotTile(Puzzle &puzzle, Tile *start_tile, bool clear)
 {
 	LOG("Plot start from: " << PP(start_tile->original_pos));
 
-	if (clear) {
-		for (int y = 0; y < size.Y * DBG_SCALE; ++y)
-			for (int x = 0; x < size.X * m_bpp * DBG_SCALE; ++x)
-				m_output[y][x] = 0x22;
-	}
+	std::vector<TilePlacement> placed;
+	getPlacement(puzzle.mapdata, placed);
+	plot(placed, clear);
+}
 
-	tilecall_t f_plot = [&] (Tile *tile) {
-		auto it = g_mapdata->find(tile);
-		if (it == g_mapdata->end()) {
-			VERBOSE("Tile not mapped: " << PP(tile->original_pos));
-			return;
+void Image::plot(const std::vector<TilePlacement> &placed, bool clear)
+{
+	loadPixels();
+	if (debug_blur)
+		renderBlur();
+	const uint8_t *const *source = debug_blur ? m_blurred_rows.data() : m_image;
+
+	// Fit the canvas to the placed tiles
+	v2s32 dim_min, dim_max;
+	getBounds(placed, dim_min, dim_max);
+	v2u32 dim = getCanvasSize(dim_min, dim_max);
+	prepareCanvas(dim.X, dim.Y, clear);
+
+	size_t bytes_per_row = (size_t)m_tilesize.X * m_bpp;
+
+	parallelFor(placed.size(), [&] (size_t i) {
+		const v2u32 &src = placed[i].original;
+		size_t x = (size_t)(placed[i].pos.X - dim_min.X) * m_tilesize.X;
+		size_t y = (size_t)(placed[i].pos.Y - dim_min.Y) * m_tilesize.Y;
+
+		VERBOSE("src=" << PP(src) << " dst=" << x << ", " << y);
+		for (uint32_t row = 0; row < m_tilesize.Y; ++row) {
+			memcpy(getCanvasRow(y + row) + x * m_bpp,
+				source[src.Y + row] + (size_t)src.X * m_bpp, bytes_per_row);
 		}
+	});
+}
+
+void Image::getBounds(const std::vector<TilePlacement> &placed,
+		v2s32 &dim_min, v2s32 &dim_max)
+{
+	if (placed.empty()) {
+		dim_min = dim_max = v2s32();
+		return;
+	}
+
+	dim_min = dim_max = placed[0].pos;
+	for (const TilePlacement &p : placed) {
+		dim_min.X = std::min(dim_min.X, p.pos.X);
+		dim_min.Y = std::min(dim_min.Y, p.pos.Y);
+		dim_max.X = std::max(dim_max.X, p.pos.X);
+		dim_max.Y = std::max(dim_max.Y, p.pos.Y);
+	}
+}
+
+v2u32 Image::getCanvasSize(const v2s32 &dim_min, const v2s32 &dim_max) const
+{
+	uint64_t width = ((int64_t)dim_max.X - dim_min.X + 1) * m_tilesize.X;
+	uint64_t height = ((int64_t)dim_max.Y - dim_min.Y + 1) * m_tilesize.Y;
 
-		v2s16 pos = it->second * v2s16(m_tilesize.X, m_tilesize.Y);
+	if (width > PNG_UINT_31_MAX || height > PNG_UINT_31_MAX)
+		ERROR("Output too large: " << width << "x" << height);
+	return v2u32(width, height);
+}
+
+void Image::saveBanded(const std::vector<TilePlacement> &placed,
+		const std::string &filepath)
+{
+	Timer t_("Image::saveBanded");
+	spillPixels();
+	if (debug_blur)
+		renderBlur();
+	const uint8_t *const *source = debug_blur ? m_blurred_rows.data() : m_image;
 
-		VERBOSE("src=" << PP(tile->original_pos) << " dst=" << PP(pos));
-		if (pos.X + m_tilesize.X > size.X * DBG_SCALE
-				|| pos.Y + m_tilesize.X > size.Y * DBG_SCALE)
-			return;
+	v2s32 dim_min, dim_max;
+	getBounds(placed, dim_min, dim_max);
+	v2u32 dim = getCanvasSize(dim_min, dim_max);
 
+	// Tiles of each output row
+	std::vector<std::vector<const TilePlacement *>> rows(dim_max.Y - dim_min.Y + 1);
+	for (const TilePlacement &p : placed)
+		rows[p.pos.Y - dim_min.Y].push_back(&p);
 
-		for (int y = 0; y < m_tilesize.Y; ++y) {
-			uint8_t *inp  = m_image[tile->original_pos.Y + y];
-			uint8_t *outp = m_output[pos.Y + y];
+	FILE *file = fopen(filepath.c_str(), "wb");
+	if (!file)
+		ERROR("Cannot upen file");
+
+	png_info *info;
+	png_struct *png = beginPNG(file, &info, dim.X, dim.Y);
+	if (setjmp(png_jmpbuf(png)))
+		ERROR("Cannot set scope to current routine");
 
-			for (int x = 0; x < m_tilesize.X * m_bpp; ++x) {
-				outp[pos.X * m_bpp + x] = 
-					inp[tile->original_pos.X * m_bpp + x];
+	// The canvas holds one row of tiles at a time
+	size_t bytes_per_row = (size_t)m_tilesize.X * m_bpp;
+	for (auto &row_tiles : rows) {
+		prepareCanvas(dim.X, m_tilesize.Y, true);
+
+		parallelFor(row_tiles.size(), [&] (size_t i) {
+			const TilePlacement &p = *row_tiles[i];
+			size_t x = (size_t)(p.pos.X - dim_min.X) * m_tilesize.X;
+			for (uint32_t row = 0; row < m_tilesize.Y; ++row) {
+				memcpy(getCanvasRow(row) + x * m_bpp,
+					source[p.original.Y + row] + (size_t)p.original.X * m_bpp,
+					bytes_per_row);
 			}
-		}
-	};
+		});
 
-	for (Tile *tile : g_pool)
-		f_plot(tile);
+		for (uint32_t row = 0; row < m_tilesize.Y; ++row)
+			png_write_row(png, getCanvasRow(row));
+	}
+
+	png_write_end(png, nullptr);
+	fclose(file);
+	png_destroy_write_struct(&png, &info);
+}
+
+void Image::getPlacement(const TileMap &map, std::vector<TilePlacement> &out)
+{
+	out.clear();
+	out.reserve(map.size());
+	for (auto &it : map)
+		out.push_back({ it.first->original_pos, it.second });
 }
@@ -1,41 +1,131 @@
 #pragma once
 
 #include "headers.h"
+#include "util/mapped_file.h"
+#include <vector>
 
 
 #define PNG_DEBUG 3
 #include <png.h>
-
-// >1 to draw a huge image to show most tiles
-#define DBG_SCALE 3
-// Show border segments of the drawn tiles
-#define DBG_BLUR
+#include <zlib.h>
 
 
+class Puzzle;
 class Tile;
+class TileMap;
+
+// Encoder settings for Image::save
+struct PngSaveOptions {
+	int level = -1;  // zlib level 0..9, -1 for the zlib default
+	int filter = -1; // PNG_FILTER_VALUE_*, -1 to pick the best per row
+	// Compress row bands on all cores and stitch them into one stream
+	bool parallel = false;
+};
+
+// Where a tile of the source image is drawn, in tile units
+struct TilePlacement {
+	v2u32 original;
+	v2s32 pos;
+};
 
 class Image {
 public:
-	Image(const std::string &filename);
+	// Reads PNG, binary PGM/PPM or, if "raw_size" is given, headerless RGB.
+	// "-" reads from stdin.
+	Image(const std::string &filename, const v2u32 &raw_size = v2u32(0, 0));
 	~Image();
-	void read(const v2u16 &n_tiles);
-	void smoothen();
+	// Creates the tiles and their face descriptors (colors and variance).
+	// "stream": extract the edges row by row while decoding, without keeping
+	// the bitmap. The pixels are decoded again later if needed for plotting.
+	void read(Puzzle &puzzle, const v2u32 &n_tiles, bool stream = false);
+	// Sets the tile geometry for plot() without reading the tiles
+	void setTileCount(const v2u32 &n_tiles);
 	void save(const std::string &filename);
 	void debugColorize(Tile *tile, uint8_t color, bool source = false);
-	void plotTile(Tile *tile, bool clear = false);
+	void plotTile(Puzzle &puzzle, Tile *tile, bool clear = false);
+	// Draws the given tiles. Does not need the puzzle, thus can run on
+	// a separate thread.
+	void plot(const std::vector<TilePlacement> &placed, bool clear = false);
+	static void getPlacement(const TileMap &map, std::vector<TilePlacement> &out);
+	// Plots and encodes one row of tiles at a time, for outputs that would
+	// not fit into memory. Ignores save_options.parallel.
+	// A PNG source is decoded into a temporary file first, see spillPixels
+	void saveBanded(const std::vector<TilePlacement> &placed,
+		const std::string &filepath);
 
 	void close();
 
 
-	v2u16 size;
+	v2u32 size;
+	// Plot the averaged border segments instead of the original pixels
+	bool debug_blur = false;
+	PngSaveOptions save_options;
 private:
-	uint8_t getAverage(const v2u16 &start, v2u16 end);
+	// Reads the header from m_input. Sets up the pixel transformations.
+	void openPNG();
+	static void readPNGCallback(png_struct *png, png_byte *data, size_t length);
+	// Points m_image to the pixels in m_input (binary PGM/PPM)
+	void openPNM();
+	void openRaw(const v2u32 &raw_size);
+	void closePNG();
+	// Decodes the entire PNG into m_pixels, if not done yet
+	void loadPixels();
+	// Same as loadPixels, but decodes row by row into a mapped temporary
+	// file. The pages can be evicted, thus the resident memory stays small.
+	void spillPixels();
+	// Like loadPixels, but always into m_pixels, which can be written to
+	void copyPixels();
+	// Resizes the output canvas. Fills it with the background color when
+	// reallocated or on "clear"
+	void prepareCanvas(uint32_t width, uint32_t height, bool clear);
+	inline uint8_t *getCanvasRow(uint32_t y)
+	{ return m_canvas + y * m_canvas_stride; }
+	// Copy of the source with each border segment filled by its average
+	void renderBlur();
+	// Writes the canvas as IDAT chunks, compressed band-wise in parallel
+	void writeParallelIDAT(FILE *file, int color_type);
+	int getColorType() const;
+	// Creates the writer and writes the header
+	png_struct *beginPNG(FILE *file, png_info **info, uint32_t width,
+		uint32_t height);
+	static void getBounds(const std::vector<TilePlacement> &placed,
+		v2s32 &dim_min, v2s32 &dim_max);
+	// Pixel size of the given tile bounds, checked against the PNG limits
+	v2u32 getCanvasSize(const v2s32 &dim_min, const v2s32 &dim_max) const;
+	// Extracts the faces while decoding row by row. Needs openPNG()
+	void readStreamed(Puzzle &puzzle, const v2u32 &n_tiles);
+
+	// Summed-area table of the sampled channel, (size.X + 1) * (size.Y + 1)
+	// entries. Wraps around on overflow, which cancels out for windows < 16M pixels.
+	// One table only: the face descriptors hold a single channel. Add one per
+	// channel when they use more.
+	void buildIntegral();
+	// Mean of the sampled channel in [start, end), O(1)
+	uint8_t getAverage(const v2u32 &start, v2u32 end);
 
-	FILE *m_file = nullptr;
+	std::string m_filepath;
+	MappedFile m_input;
+	MappedFile m_spill; // decoded PNG, see spillPixels
+	size_t m_input_offset = 0; // PNG read position
 	png_struct *m_png = nullptr;
 	png_info *m_info = nullptr;
-	uint8_t **m_image = nullptr;
-	uint8_t **m_output = nullptr;
-	v2u16 m_tilesize;
+	std::vector<uint8_t> m_pixels;
+	std::vector<const uint8_t *> m_rows;
+	const uint8_t *const *m_image = nullptr; // rows of m_pixels, m_input or m_spill
+	// Pixel order is BGR (PNG) or RGB (PGM/PPM, raw)
+	bool m_bgr = true;
+	// Channel used for the face descriptors: blue, or gray
+	int m_sample_channel = 0;
+	// Output image: one allocation, rows are m_canvas_stride bytes apart
+	uint8_t *m_canvas = nullptr;
+	size_t m_canvas_bytes = 0;
+	size_t m_canvas_stride = 0;
+	uint32_t m_canvas_width = 0,
+		m_canvas_height = 0;
+	std::vector<uint8_t> m_blurred;
+	std::vector<uint8_t *> m_blurred_rows;
+	std::vector<uint32_t> m_integral;
+	v2u32 m_n_tiles;
+	v2u32 m_tilesize;
 	int m_bpp;
 };
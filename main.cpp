@@ -1,23 +1,29 @@
 #include "headers.h"
+#include "beamsolver.h"
+#include "heapsolver.h"
 #include "image.h"
-#include "tile.h"
+#include "puzzle.h"
+#include "snapshot.h"
+#include "solution.h"
 #include "util/args_parser.h"
+#include "util/parallel.h"
 #include "util/timer.h"
 #include "util/unittest.h"
 
 #include <algorithm> // std::sort
+#include <memory>
 
 #include <unordered_map>
 
-int checkIntegrity(v2s16 pos, Tile *tile)
+int checkIntegrity(Puzzle &puzzle, v2s32 pos, Tile *tile)
 {
 	int diff = 0;
 	int n = 0;
 	for (int i = 0; i < TP_TOTAL; ++i) {
-		Tile *fix = Tile::getAtPos(pos + tile_pos_to_dir[i]);
+		Tile *fix = Tile::getAtPos(puzzle, pos + tile_pos_to_dir[i]);
 		if (!fix)
 			continue;
-		diff += tile->faces[i].getDistance(fix->faces[swapTilePos(i)]);
+		diff += tile->getFace((TILE_POS)i).getDistance(fix->getFace(swapTilePos(i)));
 		n++;
 	}
 	if (n == 0)
@@ -26,110 +32,59 @@ int checkIntegrity(v2s16 pos, Tile *tile)
 	return diff / n;
 }
 
-int closestMatchLoop(Image &img)
+int closestMatchLoop(Puzzle &puzzle, const Deadline &deadline = Deadline())
 {
-	static int min_diff = 0;
+	int &min_diff = puzzle.min_diff;
 
-	struct result_t {
-		Tile *t1;
-		Tile *t2;
-		TILE_POS face;
-		int diff;
-	};
-
-	std::vector<result_t> ranking;
-
-	TILE_POS face;
-	int d, d2;
-
-	ranking.clear();
-	ranking.reserve(g_pool.size());
-	for (Tile *t1 : g_pool) {
-		Tile::pushSeen();
-		t1->recursiveExecS(nullptr);
-
-		tilecall_t add_tile = [&] (Tile *t2) {
-			d = t1->getDistance(t2, &face);
-
-			if (d < min_diff)// || d > min_diff + 10)
-				return;
-
-			g_mapdata->clear();
-			g_mapdata->reserve(g_pool.size());
-			Tile *old_neighbour = t1->getNeighbour(face);
-
-			if (t1->link(t2, face)) {
-				d2 = t1->getDistanceAll();
-				if (d2 < d * 1.2f) {
-					ranking.push_back(result_t {
-						.t1 = t1,
-						.t2 = t2,
-						.face = face,
-						.diff = d
-					});
-				}
-			}
-
-			if (old_neighbour)
-				t1->link(old_neighbour, face);
-			else
-				t1->unlink(face);
-		};
-
-		for (Tile *t2 : g_pool)
-			t2->recursiveExecS(add_tile);
-		Tile::popSeen();
-	}
+	std::vector<RankedLink> ranking;
+	puzzle.ranking.update(puzzle, min_diff, ranking, deadline);
 
 	std::sort(ranking.begin(), ranking.end(),
-			[](const result_t &a, const result_t &b) {
+			[](const RankedLink &a, const RankedLink &b) {
 		return a.diff < b.diff;
 	});
 
 	int n = 0;
 	int moved = 0;
 	for (auto &res : ranking) {
-		g_mapdata->clear();
-		Tile *old_neighbour = res.t1->getNeighbour(res.face);
+		puzzle.begin();
 		if (res.t1->link(res.t2, res.face)) {
 			LOG(PP(res.t1->original_pos) << " <--> " << PP(res.t2->original_pos)
 				<< "  diff=" << res.diff
 				<< ", face=" << (int)res.face);
 			// OK
+			puzzle.commit();
 			moved++;
 			min_diff = res.diff;
 		} else {
-			if (old_neighbour) {
-				if (!res.t1->link(old_neighbour, res.face))
-					ERROR("Undo failed. Link code is broken!");
-			} else {
-				res.t1->unlink(res.face);
-			}
+			puzzle.rollback();
 		}
 
-		if (moved >= 40 || ++n > 100)
+		if (moved >= 40 || ++n > 100 || deadline.expired())
 			break;
 	}
 	return moved;
 }
 
-int closestMatchLoop2(Image &img)
+int closestMatchLoop2(Puzzle &puzzle, SnapshotWriter *progress)
 {
-	static int loop_n = 0; loop_n++;
+	int loop_n = ++puzzle.loop_count;
 	// Find closest edges
 	int min_diff = 0xFFFF;
 	int total_moved = 0;
-	int last_length = 1;
 
-	TILE_POS f_face;
+	TILE_POS f_face = TP_TOTAL;
 	Tile *f_tile;
 	int f_diff;
 
-	tilecall_t f_find_closest = [&] (Tile *tile) {
+	std::vector<Tile *> candidates;
+
+	auto f_find_closest = [&] (Tile *tile) {
 		if (tile->link_count >= TP_TOTAL)
 			return;
 
-		for (Tile *other : g_pool) {
+		puzzle.candidates.getAll(tile, candidates);
+		for (Tile *other : candidates) {
 			if (other == tile)
 				continue;
 
@@ -149,17 +104,17 @@ int closestMatchLoop2(Image &img)
 		}
 	};
 
-	for (Tile *tile : g_pool) {
+	for (Tile *tile : puzzle.pool) {
 		if (tile->link_count >= TP_TOTAL)
 			continue;
 
 		f_tile = nullptr;
 		f_diff = 0xFFFF;
 
-		Tile::pushSeen();
-		int n = tile->recursiveExecS(nullptr);
+		puzzle.pushSeen();
+		int n = tile->execS();
 		f_find_closest(tile);
-		Tile::popSeen();
+		puzzle.popSeen();
 
 		if (!f_tile)
 			continue;
@@ -168,30 +123,20 @@ int closestMatchLoop2(Image &img)
 			<< " :: diff=" << f_diff << ", face=" << (int)f_face
 			<< ", len=" << n + 1);
 
-		Tile *old_neighbour = tile->getNeighbour(f_face);
+		puzzle.begin();
 		if (!tile->link(f_tile, f_face)) {
-			// Undo
-			tile->link(old_neighbour, f_face);
+			puzzle.rollback();
 			WARN(" ^ Link failed!");
 			continue;
 		}
+		puzzle.commit();
 
 		int moved = 1;
 
 		// Statistics and debug
 		// Refresh the image for each step
-#if 1
-	#if 1
-		Unittest::updateImage(&img, true);
-		getchar();
-	#else
-		int new_length = Unittest::updateImage(&img, true);
-		if (new_length > last_length) {
-			last_length = new_length;
-			getchar();
-		}
-	#endif
-#endif
+		if (progress)
+			progress->post(puzzle);
 
 		total_moved += moved;
 		if (f_diff < min_diff)
@@ -204,39 +149,285 @@ int closestMatchLoop2(Image &img)
 	return min_diff;
 }
 
-int main(int argc, char **argv)
+enum class SolverType {
+	LOOP, // closestMatchLoop until nothing moves
+	HEAP, // HeapSolver, single pass
+	BEAM  // BeamSolver
+};
+
+struct SolveOptions {
+	SolverType solver = SolverType::LOOP;
+	v2u32 n_tiles;
+	// Size of headerless RGB input, (0, 0) to detect the format
+	v2u32 raw_size;
+	size_t k; // candidates per face
+	size_t beam_width = 8;
+	size_t beam_memory = 256; // MiB
+	// Write progress images every N ms, 0 to disable
+	int progress_ms = 0;
+	// Keep every progress image instead of overwriting the last one
+	bool progress_numbered = false;
+	// Write the placement as .sol and .json file
+	bool save_solution = false;
+	// Render and encode the solved image
+	bool save_image = true;
+	PngSaveOptions png;
+	// Extract the edges while decoding the image
+	bool stream = false;
+	// Bounded memory: stream the input and write the output in tile rows
+	bool banded = false;
+	// Plot the averaged border segments
+	bool blur = false;
+	// Wall-clock limit per puzzle in ms, 0 to disable
+	long time_budget_ms = 0;
+};
+
+// Solves one puzzle with its own context. Safe to call from multiple threads.
+// "out_base": output path without file extension
+void solvePuzzle(const std::string &file, const SolveOptions &opts,
+		const std::string &out_base)
+{
+	// Includes reading the image, excludes writing the results
+	Deadline deadline(opts.time_budget_ms);
+	Puzzle puzzle;
+
+	Image img(file, opts.raw_size);
+	img.debug_blur = opts.blur;
+	img.save_options = opts.png;
+	img.read(puzzle, opts.n_tiles, opts.stream || opts.banded);
+	puzzle.compat.build(puzzle.pool, deadline);
+	puzzle.candidates.build(puzzle.pool, puzzle.compat, opts.k, deadline);
+	LOG("Read image " << file);
+
+	{
+		std::unique_ptr<SnapshotWriter> progress;
+		if (opts.progress_ms > 0) {
+			progress.reset(new SnapshotWriter(&img, out_base + "_progress",
+				opts.progress_ms, opts.progress_numbered));
+		}
+
+		if (puzzle.candidates.empty()) {
+			// Time budget exceeded, nothing to solve with
+		} else if (opts.solver == SolverType::HEAP) {
+			HeapSolver(puzzle).run(deadline);
+			if (progress)
+				progress->post(puzzle);
+		} else if (opts.solver == SolverType::BEAM) {
+			BeamSolver(puzzle, opts.beam_width, opts.beam_memory).run(deadline);
+			if (progress)
+				progress->post(puzzle);
+		} else {
+			// A conflict may unlink tiles, thus a round can make it worse.
+			// With a time budget, everything since the best state is
+			// recorded to return there.
+			const bool track_best = deadline.enabled();
+			SolveQuality best;
+			if (track_best) {
+				best = puzzle.getQuality();
+				puzzle.begin();
+			}
+
+			int moved = 0;
+			int rounds = 0;
+			do {
+				if (deadline.expired()) {
+					WARN("Time budget exceeded after " << rounds << " rounds");
+					break;
+				}
+
+				moved = closestMatchLoop(puzzle, deadline);
+				rounds++;
+				if (progress)
+					progress->post(puzzle);
+
+				if (!track_best)
+					continue;
+
+				SolveQuality q = puzzle.getQuality();
+				if (!best.isBetterThan(q)) {
+					best = q;
+					puzzle.commit();
+					puzzle.begin();
+				}
+			} while (moved > 0);
+
+			if (!track_best) {
+				// Nothing recorded
+			} else if (best.isBetterThan(puzzle.getQuality())) {
+				LOG("Restoring the best state");
+				puzzle.rollback();
+			} else {
+				puzzle.commit();
+			}
+		}
+	} // Finish the last progress image
+
+	SolveQuality quality = puzzle.getQuality();
+	LOG("Quality: fragments=" << quality.fragments
+		<< ", largest=" << quality.largest << "/" << puzzle.pool.size()
+		<< ", links=" << quality.links << ", mean_diff=" << quality.mean_diff);
+
+	Tile *center;
+	Tile::sortAllUnsafe(puzzle, center);
+
+	if (opts.save_solution) {
+		Solution solution;
+		solution.fromPuzzle(puzzle, img.size, opts.n_tiles);
+		solution.quality = quality;
+		solution.saveBinary(out_base + ".sol");
+		solution.saveJSON(out_base + ".json");
+	}
+	if (opts.save_image && opts.banded) {
+		std::vector<TilePlacement> placed;
+		Image::getPlacement(puzzle.mapdata, placed);
+		img.saveBanded(placed, out_base + ".png");
+	} else if (opts.save_image) {
+		img.plotTile(puzzle, center);
+		img.save(out_base + ".png");
+	}
+}
+
+// Draws a previously saved solution with the pixels of the source image
+void assembleSolution(const std::string &file, const std::string &sol_file,
+		const SolveOptions &opts, const std::string &out_file)
 {
-	//Unittest test;
+	Solution solution;
+	solution.loadBinary(sol_file);
+
+	Image img(file, opts.raw_size);
+	if (img.size != solution.image_size)
+		ERROR("Solution does not match the image size " << PP(img.size));
+
+	std::vector<TilePlacement> placed;
+	solution.getPlacement(placed);
+
+	img.debug_blur = opts.blur;
+	img.save_options = opts.png;
+	img.setTileCount(solution.n_tiles);
+	if (opts.banded) {
+		img.saveBanded(placed, out_file);
+	} else {
+		img.plot(placed);
+		img.save(out_file);
+	}
+}
 
+int main(int argc, char **argv)
+{
 	// difficult: 
+	// Comma-separated list to solve multiple puzzles concurrently
 	CLIArgStr ca_file("f", "images/simple.png");
 	CLIArgS64 ca_xt("x", 4);
 	CLIArgS64 ca_yt("y", 4);
 	// 21 x 30
+	// loop, heap or beam
+	CLIArgStr ca_solver("solver", "loop");
+	// Partial assemblies kept by the beam solver
+	CLIArgS64 ca_beam_width("beam-width", 8);
+	// Memory limit of the beam solver in MiB, reduces the width if exceeded
+	CLIArgS64 ca_beam_memory("beam-memory", 256);
+	// Partners to evaluate per tile face
+	CLIArgS64 ca_candidates("k", 16);
+	// Input is headerless RGB of the given size, e.g. "1024x768"
+	CLIArgStr ca_raw("raw", "");
+	// Do not keep the decoded image in memory while reading the tiles
+	CLIArgFlag ca_stream("stream");
+	// Bounded memory mode for huge scans: implies -stream, writes the
+	// output image one row of tiles at a time
+	CLIArgFlag ca_banded("banded");
+	CLIArgFlag ca_blur("blur");
+	// Progress image interval in ms, written in the background
+	CLIArgS64 ca_progress("progress", 0);
+	CLIArgFlag ca_progress_numbered("progress-numbered");
+	// Export the tile placement (.sol + .json)
+	CLIArgFlag ca_solution("solution");
+	// Also write the image when "-solution" is given
+	CLIArgFlag ca_png("png");
+	// Draw the given .sol file using the image of "-f", then exit
+	CLIArgStr ca_assemble("assemble", "");
+	// zlib level 0..9
+	CLIArgS64 ca_png_level("png-level", -1);
+	// none, sub, up, avg, paeth or adaptive
+	CLIArgStr ca_png_filter("png-filter", "adaptive");
+	// Compress the output image on all cores
+	CLIArgFlag ca_png_parallel("png-parallel");
+	// Per puzzle in ms: stop solving and write the best result so far
+	CLIArgS64 ca_time_budget("time-budget", 0);
+	CLIArgFlag ca_test("test");
 	CLIArg::parseArgs(argc, argv);
 
-	LOG("Startup....");
+	if (ca_test.get())
+		Unittest test;
 
-	Image img(ca_file.get());
-	img.read(v2u16(ca_xt.get(), ca_yt.get()));
-	img.smoothen();
-	LOG("Read image");
+	LOG("Startup.... face kernel: " << Face::getKernel()->name);
 
-	int i = 0;
-	int moved = 0;
-	do {
-		moved = closestMatchLoop(img);
-		if (++i == 30) {
-			i = 0;
-			Unittest::updateImage(&img, true);
-			getchar();
+	std::vector<std::string> files;
+	{
+		const std::string &list = ca_file.get();
+		size_t start = 0, end;
+		do {
+			end = list.find(',', start);
+			files.push_back(list.substr(start, end - start));
+			start = end + 1;
+		} while (end != std::string::npos);
+	}
+
+	SolveOptions opts;
+	opts.n_tiles = v2u32(ca_xt.get(), ca_yt.get());
+	opts.k = ca_candidates.get();
+	opts.beam_width = std::max<int64_t>(ca_beam_width.get(), 1);
+	opts.beam_memory = std::max<int64_t>(ca_beam_memory.get(), 1);
+	if (ca_solver.get() == "heap")
+		opts.solver = SolverType::HEAP;
+	else if (ca_solver.get() == "beam")
+		opts.solver = SolverType::BEAM;
+	else if (ca_solver.get() != "loop")
+		ERROR("Unknown solver: " << ca_solver.get());
+	if (!ca_raw.get().empty()) {
+		unsigned w = 0, h = 0;
+		if (sscanf(ca_raw.get().c_str(), "%ux%u", &w, &h) != 2
+				|| w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX)
+			ERROR("Invalid raw size: " << ca_raw.get());
+		opts.raw_size = v2u32(w, h);
+	}
+	opts.stream = ca_stream.get();
+	opts.banded = ca_banded.get();
+	opts.blur = ca_blur.get();
+	opts.progress_ms = ca_progress.get();
+	opts.time_budget_ms = std::max<int64_t>(ca_time_budget.get(), 0);
+	opts.progress_numbered = ca_progress_numbered.get();
+	opts.save_solution = ca_solution.get();
+	// Encoding is the most expensive part of a batch job: no image by
+	// default if the placement is exported
+	opts.save_image = ca_png.get() || !ca_solution.get();
+	opts.png.level = RANGELIM(ca_png_level.get(), -1, 9);
+	opts.png.parallel = ca_png_parallel.get();
+	{
+		static const char *filters[] = { "none", "sub", "up", "avg", "paeth" };
+		opts.png.filter = -1;
+		for (int i = 0; i < 5; ++i) {
+			if (ca_png_filter.get() == filters[i])
+				opts.png.filter = i;
 		}
-	} while (moved > 0);
+		if (opts.png.filter < 0 && ca_png_filter.get() != "adaptive")
+			ERROR("Unknown PNG filter: " << ca_png_filter.get());
+	}
 
-	Tile *center;
-	Tile::sortAllUnsafe(center);
-	img.plotTile(center);
-	img.save("images/out.png");
+	if (!ca_assemble.get().empty()) {
+		assembleSolution(ca_file.get(), ca_assemble.get(), opts,
+			"images/out.png");
+		return 0;
+	}
+
+	if (files.size() == 1) {
+		solvePuzzle(files[0], opts, "images/out");
+		return 0;
+	}
+
+	// Independent contexts: one puzzle per thread
+	parallelFor(files.size(), [&] (size_t i) {
+		solvePuzzle(files[i], opts,
+			"images/out_" + std::to_string(i));
+	});
 	return 0;
 }
-
@@ -0,0 +1,124 @@
+#include "puzzle.h"
+#include <algorithm>
+
+Puzzle::Puzzle() :
+	pool(this)
+{
+}
+
+void Puzzle::begin()
+{
+	m_journal_marks.push_back(m_journal.size());
+	fragments.begin();
+}
+
+void Puzzle::commit()
+{
+	if (m_journal_marks.empty())
+		ERROR("No change to commit");
+
+	m_journal_marks.pop_back();
+	if (m_journal_marks.empty())
+		m_journal.clear();
+	fragments.commit();
+}
+
+void Puzzle::rollback()
+{
+	if (m_journal_marks.empty())
+		ERROR("No change to roll back");
+
+	size_t mark = m_journal_marks.back();
+	m_journal_marks.pop_back();
+
+	while (m_journal.size() > mark) {
+		const JournalEntry &e = m_journal.back();
+		Tile *tile = pool[e.tile];
+		tile->link_count += (e.old != TILE_NONE) - (tile->neighbours[e.face] != TILE_NONE);
+		tile->neighbours[e.face] = e.old;
+		m_journal.pop_back();
+	}
+	fragments.rollback();
+}
+
+int Puzzle::getFaceDistance(const Tile *a, TILE_POS face, const Tile *b) const
+{
+	if (!compat.empty())
+		return compat.get(a->index, b->index)[face];
+
+	return a->getFace(face).getDistance(b->getFace(swapTilePos(face)));
+}
+
+void Puzzle::pushSeen()
+{
+	m_seen_levels.push_back(++m_seen_stamp);
+}
+
+void Puzzle::popSeen()
+{
+	if (m_seen_levels.size() <= 1)
+		ERROR("Seen == 0");
+
+	// Stamps of this level are newer than the outer one, thus they
+	// automatically count as "seen" by the outer traversal
+	m_seen_levels.pop_back();
+}
+
+SolveQuality Puzzle::getQuality() const
+{
+	SolveQuality q;
+	int64_t sum = 0;
+	for (size_t i = 0; i < pool.size(); ++i) {
+		const Tile *tile = pool[i];
+		if (fragments.getRoot(tile) == tile) {
+			q.fragments++;
+			q.largest = std::max(q.largest, fragments.getSize(tile));
+		}
+
+		// Each link once, seen from the left or upper tile
+		for (int face = TP_RIGHT; face <= TP_BOTTOM; ++face) {
+			const Tile *other = tile->getNeighbour((TILE_POS)face);
+			if (!other)
+				continue;
+			sum += getFaceDistance(tile, (TILE_POS)face, other);
+			q.links++;
+		}
+	}
+	if (q.links > 0)
+		q.mean_diff = sum / q.links;
+	return q;
+}
+
+bool Puzzle::mergeFragments(Tile *a, TILE_POS face, Tile *b)
+{
+	struct Contact {
+		Tile *a;
+		TILE_POS face;
+		Tile *b;
+	};
+	std::vector<Contact> contacts;
+	bool ok = fragments.forEachContact(a, b, face,
+			[&] (Tile *t1, TILE_POS t1_face, Tile *t2) {
+		contacts.push_back(Contact { t1, t1_face, t2 });
+	});
+	if (!ok)
+		return false;
+
+	begin();
+	if (!a->link(b, face)) {
+		rollback();
+		return false;
+	}
+
+	// The other tiles that now touch each other
+	for (const Contact &c : contacts) {
+		if (c.a->getNeighbour(c.face) == c.b)
+			continue;
+		if (!c.a->link(c.b, c.face)) {
+			rollback();
+			return false;
+		}
+	}
+	commit();
+	return true;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "candidates.h"
+#include "compat.h"
+#include "fragments.h"
+#include "ranking.h"
+#include "tile.h"
+#include "tilemap.h"
+
+// Estimate of how good the current assembly is, without knowing the answer
+struct SolveQuality {
+	size_t fragments = 0; // 1 = complete
+	size_t largest = 0; // tiles in the largest fragment
+	size_t links = 0;
+	int mean_diff = 0; // mean face distance of all links
+
+	// Fewer fragments first, then closer matches
+	bool isBetterThan(const SolveQuality &o) const
+	{
+		if (fragments != o.fragments)
+			return fragments < o.fragments;
+		return mean_diff < o.mean_diff;
+	}
+};
+
+// All state of one puzzle. Nothing in here is shared with other puzzles,
+// thus multiple ones can be solved concurrently within one process.
+class Puzzle {
+public:
+	Puzzle();
+	Puzzle(const Puzzle &) = delete;
+
+	TileStore pool;
+	TileMap mapdata;
+	Fragments fragments;
+	CompatMatrix compat;
+	CandidateIndex candidates;
+	LinkRanking ranking;
+
+	// Undo log of all link changes. Calls may be nested.
+	// rollback() restores the links and the placement as they were on begin()
+	void begin();
+	void commit();
+	void rollback();
+	inline bool isRecording() const { return !m_journal_marks.empty(); }
+
+	// Traversal levels, see Tile::execS
+	// Both O(1): every level gets a new, larger stamp
+	void pushSeen();
+	void popSeen();
+	inline uint64_t getSeenStamp() const { return m_seen_levels.back(); }
+
+	// Distance of "face" of "a" to the opposite face of "b"
+	int getFaceDistance(const Tile *a, TILE_POS face, const Tile *b) const;
+	// Links "b" to "face" of "a", then every other pair of tiles that
+	// touches after merging both fragments. Nothing changes on failure.
+	// out: false on overlap
+	bool mergeFragments(Tile *a, TILE_POS face, Tile *b);
+	SolveQuality getQuality() const;
+
+	// closestMatchLoop: distance of the last accepted link
+	int min_diff = 0;
+	// closestMatchLoop2: number of rounds
+	int loop_count = 0;
+
+private:
+	friend class Tile;
+
+	struct JournalEntry {
+		uint32_t tile;
+		TILE_POS face;
+		uint32_t old;
+	};
+	std::vector<JournalEntry> m_journal;
+	std::vector<size_t> m_journal_marks;
+
+	uint64_t m_seen_stamp = 1; // last handed out
+	std::vector<uint64_t> m_seen_levels { 1 }; // stamp of each level
+};
+
+// Tile functions that need the Puzzle to be complete
+
+inline Tile *Tile::getNeighbour(TILE_POS face) const
+{
+	if (face == TP_TOTAL)
+		ERROR("Wrong face");
+
+	uint32_t i = neighbours[face];
+	return i == TILE_NONE ? nullptr : m_puzzle->pool[i];
+}
+
+inline Face Tile::getFace(TILE_POS face) const
+{
+	return m_puzzle->pool.getFace(index, face);
+}
+
+inline bool Tile::getSeenDiff() const
+{
+	return m_seen < m_puzzle->getSeenStamp();
+}
+
+template<typename F>
+int Tile::execS(F func)
+{
+	const uint64_t stamp = m_puzzle->getSeenStamp();
+	int executed = 0;
+
+	std::vector<Tile *> stack;
+	stack.push_back(this);
+
+	while (!stack.empty()) {
+		Tile *tile = stack.back();
+		stack.pop_back();
+
+		if (tile->m_seen >= stamp)
+			continue;
+		tile->m_seen = stamp;
+
+		executed++;
+		func(tile);
+
+		// Reverse order: visit the first face first, like the recursion did
+		for (int i = TP_TOTAL - 1; i >= 0; --i) {
+			Tile *next = tile->getNeighbour((TILE_POS)i);
+			if (next && next->m_seen < stamp)
+				stack.push_back(next);
+		}
+	}
+	return executed;
+}
+
+inline int Tile::execS()
+{
+	return execS([] (Tile *) {});
+}
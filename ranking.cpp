@@ -0,0 +1,112 @@
+#include "ranking.h"
+#include "puzzle.h"
+#include "util/parallel.h"
+#include <atomic>
+
+void LinkRanking::clear()
+{
+	m_entries.clear();
+	m_changed.clear();
+}
+
+void LinkRanking::update(Puzzle &puzzle, int min_diff, std::vector<RankedLink> &out,
+		const Deadline &deadline)
+{
+	const size_t n = puzzle.pool.size();
+	const Fragments &fragments = puzzle.fragments;
+
+	if (m_entries.size() != n) {
+		m_entries.assign(n, Entry { 0, {}, {} });
+		m_changed.assign(n, 1);
+	} else {
+		for (size_t i = 0; i < n; ++i)
+			m_changed[i] = m_entries[i].stamp != fragments.getStamp(puzzle.pool[i]);
+	}
+
+	// Candidate lists may be rebuilt on access, thus collect them serially.
+	// All pairs are scored again if the list changed.
+	std::vector<Tile *> todo;
+	std::vector<uint8_t> todo_all;
+	std::vector<Tile *> partners;
+	for (Tile *t1 : puzzle.pool) {
+		Entry &e = m_entries[t1->index];
+		bool dirty = m_changed[t1->index];
+		for (size_t i = 0; !dirty && i < e.partners.size(); ++i)
+			dirty = m_changed[e.partners[i]->index];
+		if (!dirty)
+			continue;
+
+		puzzle.candidates.getAll(t1, partners);
+		bool all = m_changed[t1->index] || partners != e.partners;
+		if (all)
+			e.partners.swap(partners);
+		todo.push_back(t1);
+		todo_all.push_back(all);
+	}
+
+	// Score on all cores. Nothing is linked in this phase, the fragments
+	// are only read. Each tile has its own list, thus the result is the
+	// same for any thread count.
+	std::atomic<size_t> n_scored(0);
+	parallelFor(todo.size(), [&] (size_t i) {
+		if (deadline.expired())
+			return;
+		n_scored += score(puzzle, todo[i], todo_all[i]);
+	});
+
+	for (Tile *t1 : puzzle.pool)
+		m_entries[t1->index].stamp = fragments.getStamp(t1);
+
+	out.clear();
+	if (deadline.expired()) {
+		// Stamps start at 1: scores all pairs of these tiles next time
+		for (Tile *t1 : todo)
+			m_entries[t1->index].stamp = 0;
+		return;
+	}
+
+	VERBOSE("Scored " << n_scored << " pairs of " << todo.size() << " tiles");
+
+	for (const Entry &e : m_entries) {
+		for (const RankedLink &link : e.links) {
+			if (link.diff >= min_diff)
+				out.push_back(link);
+		}
+	}
+}
+
+size_t LinkRanking::score(const Puzzle &puzzle, Tile *t1, bool all)
+{
+	const Fragments &fragments = puzzle.fragments;
+	Entry &e = m_entries[t1->index];
+	Tile *root = fragments.getRoot(t1);
+	size_t scored = 0;
+
+	e.links.resize(e.partners.size());
+	for (size_t i = 0; i < e.partners.size(); ++i) {
+		Tile *t2 = e.partners[i];
+		if (!all && !m_changed[t2->index])
+			continue;
+
+		RankedLink &link = e.links[i];
+		link = RankedLink { t1, t2, TP_TOTAL, -1 };
+		scored++;
+
+		if (fragments.getRoot(t2) == root)
+			continue; // same fragment
+
+		TILE_POS face;
+		int d = t1->getDistance(t2, &face);
+		if (d < 0)
+			continue; // no free face pair, "face" is not set
+		if (!fragments.canMerge(t1, t2, face))
+			continue;
+
+		int d2 = t1->getDistanceAll(t2, face);
+		if (d2 < d * 1.2f) {
+			link.face = face;
+			link.diff = d;
+		}
+	}
+	return scored;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "tile.h"
+#include "util/timer.h"
+
+struct RankedLink {
+	Tile *t1;
+	Tile *t2;
+	TILE_POS face; // of t1
+	int diff;
+};
+
+// Trial links of closestMatchLoop, kept across its rounds.
+// A pair of tiles is only scored again when the fragment of either tile
+// changed since the last update.
+class LinkRanking {
+public:
+	// Re-scores the changed tiles
+	// out: all links with diff >= min_diff, in tile order. Empty if
+	//      "deadline" expired, the unfinished tiles are scored next time.
+	void update(Puzzle &puzzle, int min_diff, std::vector<RankedLink> &out,
+		const Deadline &deadline = Deadline());
+	void clear();
+
+private:
+	struct Entry {
+		uint64_t stamp; // Fragments::getStamp when scored
+		std::vector<Tile *> partners;
+		// One per partner, diff = -1 if not possible
+		std::vector<RankedLink> links;
+	};
+	// "all": new partner list, else only the changed partners
+	// out: number of scored pairs
+	size_t score(const Puzzle &puzzle, Tile *t1, bool all);
+
+	std::vector<Entry> m_entries;
+	std::vector<uint8_t> m_changed;
+};
@@ -0,0 +1,157 @@
+#include "snapshot.h"
+#include "puzzle.h"
+#include <algorithm>
+#include <cstdio>
+
+SnapshotWriter::SnapshotWriter(Image *img, const std::string &path,
+		int interval_ms, bool numbered) :
+	m_img(img),
+	m_path(path),
+	m_interval(interval_ms),
+	m_numbered(numbered)
+{
+	m_last_post = std::chrono::steady_clock::now() - m_interval;
+	m_thread = std::thread(&SnapshotWriter::run, this);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = true;
+	}
+	m_wakeup.notify_one();
+	m_thread.join();
+}
+
+bool SnapshotWriter::post(Puzzle &puzzle)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - m_last_post < m_interval)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_busy || m_has_pending)
+			return false; // encoder is behind
+	}
+	m_last_post = now;
+
+	const Fragments &fragments = puzzle.fragments;
+	m_tiles.resize(puzzle.pool.size());
+	for (Tile *tile : puzzle.pool) {
+		m_tiles[tile->index] = TileState { tile->original_pos,
+			fragments.getRoot(tile)->index, fragments.getOffset(tile) };
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_pending.swap(m_tiles);
+		m_has_pending = true;
+	}
+	m_wakeup.notify_one();
+	return true;
+}
+
+void SnapshotWriter::layout(const std::vector<TileState> &tiles,
+		std::vector<TilePlacement> &out)
+{
+	struct Fragment {
+		v2s32 min, max;
+		size_t size = 0;
+		v2s32 pos; // of the root
+		bool placed = false;
+	};
+	std::vector<Fragment> fragments(tiles.size()); // by root
+
+	for (const TileState &t : tiles) {
+		Fragment &f = fragments[t.root];
+		if (f.size++ == 0) {
+			f.min = f.max = t.offset;
+			continue;
+		}
+		f.min.X = std::min(f.min.X, t.offset.X);
+		f.min.Y = std::min(f.min.Y, t.offset.Y);
+		f.max.X = std::max(f.max.X, t.offset.X);
+		f.max.Y = std::max(f.max.Y, t.offset.Y);
+	}
+
+	// The first largest fragment at the origin, the others to the right
+	uint32_t center = 0;
+	for (const TileState &t : tiles) {
+		if (fragments[t.root].size > fragments[center].size)
+			center = t.root;
+	}
+
+	const int32_t SPACE = Tile::SORT_SPACE;
+	v2s32 dim_min, dim_max;
+	if (!tiles.empty()) {
+		Fragment &f = fragments[center];
+		f.pos = v2s32() - f.min;
+		f.placed = true;
+		dim_max = f.max - f.min;
+		dim_max.X += SPACE;
+	}
+
+	for (const TileState &t : tiles) {
+		Fragment &f = fragments[t.root];
+		if (f.placed)
+			continue;
+
+		f.pos = v2s32(dim_max.X - f.min.X, dim_min.Y - f.min.Y);
+		f.placed = true;
+		dim_max.X += SPACE + (f.max.X - f.min.X);
+		dim_max.Y = std::max(dim_max.Y, f.max.Y - f.min.Y);
+
+		if (dim_max.X >= SPACE * 20) {
+			dim_min.Y += dim_max.Y + SPACE;
+			dim_max.X = 0;
+			dim_max.Y = 0;
+		}
+	}
+
+	out.resize(tiles.size());
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		const TileState &t = tiles[i];
+		out[i] = TilePlacement { t.original, t.offset + fragments[t.root].pos };
+	}
+}
+
+void SnapshotWriter::run()
+{
+	std::vector<TileState> tiles;
+	std::vector<TilePlacement> placed;
+	size_t frame = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_wakeup.wait(guard, [this] {
+				return m_has_pending || m_stop;
+			});
+			if (!m_has_pending)
+				break; // stopped
+
+			tiles.swap(m_pending);
+			m_has_pending = false;
+			m_busy = true;
+		}
+
+		std::string file;
+		if (m_numbered) {
+			char suffix[16];
+			snprintf(suffix, sizeof(suffix), "_%04zu.png", frame);
+			file = m_path + suffix;
+		} else {
+			file = m_path + ".png";
+		}
+		frame++;
+
+		layout(tiles, placed);
+		m_img->plot(placed, true);
+		m_img->save(file);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_busy = false;
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "image.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Puzzle;
+
+// Renders and encodes progress images on a background thread.
+// The solver only copies the fragment of each tile, the layout is done
+// by the writer.
+class SnapshotWriter {
+public:
+	// Per tile, as copied from Puzzle::fragments
+	struct TileState {
+		v2u32 original;
+		uint32_t root; // pool index of the fragment root
+		v2s32 offset;  // to the root
+	};
+
+	// "interval_ms": minimal time between two frames
+	// "numbered": write "<path>_0000.png", "<path>_0001.png", ... instead of
+	//             overwriting "<path>.png"
+	SnapshotWriter(Image *img, const std::string &path, int interval_ms,
+		bool numbered);
+	// Writes the pending frame, if any
+	~SnapshotWriter();
+
+	// Never waits for the encoder. Drops the frame if it is too early
+	// or the previous one is still being written.
+	bool post(Puzzle &puzzle);
+
+	// Places the fragments like Tile::sortAllUnsafe. out[i] is tiles[i].
+	static void layout(const std::vector<TileState> &tiles,
+		std::vector<TilePlacement> &out);
+
+private:
+	void run();
+
+	Image *m_img;
+	std::string m_path;
+	std::chrono::milliseconds m_interval;
+	bool m_numbered;
+	std::chrono::steady_clock::time_point m_last_post;
+
+	std::thread m_thread;
+	std::mutex m_lock;
+	std::condition_variable m_wakeup;
+	// Protected by m_lock
+	std::vector<TileState> m_pending;
+	bool m_has_pending = false;
+	bool m_busy = false;
+	bool m_stop = false;
+
+	// Used by the solver thread only
+	std::vector<TileState> m_tiles;
+};
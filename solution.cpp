@@ -0,0 +1,230 @@
+#include "solution.h"
+#include "puzzle.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_set>
+
+/*
+	Binary format, all values little-endian:
+		char[4]  magic "UESL"
+		u16      version
+		u32[2]   image size
+		u32[2]   tile count
+		u32      number of entries
+	Per entry:
+		u32[2]   original position (pixels)
+		s32[2]   solved position (tiles)
+		u16[4]   edge distances, 0xFFFF if not linked
+*/
+static const char SOLUTION_MAGIC[4] = { 'U', 'E', 'S', 'L' };
+static const uint16_t SOLUTION_VERSION = 2;
+
+static void writeU16(std::ostream &os, uint16_t v)
+{
+	char buf[2] = { (char)(v & 0xFF), (char)(v >> 8) };
+	os.write(buf, 2);
+}
+
+static void writeU32(std::ostream &os, uint32_t v)
+{
+	writeU16(os, v & 0xFFFF);
+	writeU16(os, v >> 16);
+}
+
+static uint16_t readU16(std::istream &is)
+{
+	uint8_t buf[2] = { 0, 0 };
+	is.read((char *)buf, 2);
+	return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t readU32(std::istream &is)
+{
+	uint32_t low = readU16(is);
+	return low | (uint32_t)readU16(is) << 16;
+}
+
+void Solution::fromPuzzle(Puzzle &puzzle, const v2u32 &image_size,
+		const v2u32 &n_tiles)
+{
+	this->image_size = image_size;
+	this->n_tiles = n_tiles;
+	entries.clear();
+	entries.reserve(puzzle.mapdata.size());
+
+	for (auto &it : puzzle.mapdata) {
+		Tile *tile = it.first;
+		Entry entry;
+		entry.place = TilePlacement { tile->original_pos, it.second };
+
+		for (int i = 0; i < TP_TOTAL; ++i) {
+			Tile *other = tile->getNeighbour((TILE_POS)i);
+			if (!other)
+				entry.edges[i] = NO_EDGE;
+			else
+				entry.edges[i] = puzzle.getFaceDistance(tile, (TILE_POS)i, other);
+		}
+		entries.push_back(entry);
+	}
+
+	// Deterministic output: source order
+	std::sort(entries.begin(), entries.end(), [] (const Entry &a, const Entry &b) {
+		return a.place.original.Y < b.place.original.Y
+			|| (a.place.original.Y == b.place.original.Y
+				&& a.place.original.X < b.place.original.X);
+	});
+}
+
+void Solution::getPlacement(std::vector<TilePlacement> &out) const
+{
+	out.clear();
+	out.reserve(entries.size());
+	for (const Entry &entry : entries)
+		out.push_back(entry.place);
+}
+
+void Solution::saveBinary(const std::string &filepath) const
+{
+	std::ofstream os(filepath, std::ios::binary);
+	if (!os.good())
+		ERROR("Cannot open file " << filepath);
+
+	os.write(SOLUTION_MAGIC, 4);
+	writeU16(os, SOLUTION_VERSION);
+	writeU32(os, image_size.X);
+	writeU32(os, image_size.Y);
+	writeU32(os, n_tiles.X);
+	writeU32(os, n_tiles.Y);
+	writeU32(os, entries.size());
+
+	for (const Entry &entry : entries) {
+		writeU32(os, entry.place.original.X);
+		writeU32(os, entry.place.original.Y);
+		writeU32(os, entry.place.pos.X);
+		writeU32(os, entry.place.pos.Y);
+		for (int i = 0; i < TP_TOTAL; ++i)
+			writeU16(os, entry.edges[i]);
+	}
+}
+
+void Solution::loadBinary(const std::string &filepath)
+{
+	std::ifstream is(filepath, std::ios::binary);
+	if (!is.good())
+		ERROR("Cannot open file " << filepath);
+
+	char magic[4];
+	is.read(magic, 4);
+	if (!is.good() || memcmp(magic, SOLUTION_MAGIC, 4) != 0)
+		ERROR("Not a solution file: " << filepath);
+
+	uint16_t version = readU16(is);
+	if (version != SOLUTION_VERSION)
+		ERROR("Unsupported solution version " << version);
+
+	image_size.X = readU32(is);
+	image_size.Y = readU32(is);
+	n_tiles.X = readU32(is);
+	n_tiles.Y = readU32(is);
+	uint32_t count = readU32(is);
+
+	if (!is.good() || count > (uint64_t)n_tiles.X * n_tiles.Y)
+		ERROR("Corrupt solution file: " << filepath);
+
+	entries.resize(count);
+	for (Entry &entry : entries) {
+		entry.place.original.X = readU32(is);
+		entry.place.original.Y = readU32(is);
+		entry.place.pos.X = (int32_t)readU32(is);
+		entry.place.pos.Y = (int32_t)readU32(is);
+		for (int i = 0; i < TP_TOTAL; ++i)
+			entry.edges[i] = readU16(is);
+	}
+
+	if (!is.good())
+		ERROR("Truncated solution file: " << filepath);
+
+	if (!isValid())
+		ERROR("Corrupt solution file: " << filepath);
+}
+
+bool Solution::isValid() const
+{
+	if (n_tiles.X == 0 || n_tiles.Y == 0)
+		return false;
+
+	const v2u32 tilesize = image_size / n_tiles;
+	if (tilesize.X == 0 || tilesize.Y == 0)
+		return false;
+	if (entries.empty())
+		return true;
+
+	// Tile::sortAllUnsafe places the fragments next to each other with a gap
+	// of SORT_SPACE tiles. A fragment spans at most one tile per tile in it.
+	const int64_t max_span = (int64_t)n_tiles.X * n_tiles.Y * (1 + Tile::SORT_SPACE);
+	v2s32 min = entries[0].place.pos,
+		max = min;
+
+	std::unordered_set<unsigned long long> originals, positions;
+	for (const Entry &entry : entries) {
+		const v2u32 &original = entry.place.original;
+		const v2s32 &pos = entry.place.pos;
+
+		// Must be a tile of the source grid
+		if (original.X % tilesize.X != 0 || original.Y % tilesize.Y != 0
+				|| original.X / tilesize.X >= n_tiles.X
+				|| original.Y / tilesize.Y >= n_tiles.Y)
+			return false;
+
+		if (!originals.insert((unsigned long long)original.Y << 32 | original.X).second)
+			return false;
+		if (!positions.insert(pos.getHash()).second)
+			return false;
+
+		min.X = std::min(min.X, pos.X);
+		min.Y = std::min(min.Y, pos.Y);
+		max.X = std::max(max.X, pos.X);
+		max.Y = std::max(max.Y, pos.Y);
+	}
+
+	return (int64_t)max.X - min.X < max_span
+		&& (int64_t)max.Y - min.Y < max_span;
+}
+
+void Solution::saveJSON(const std::string &filepath) const
+{
+	std::ofstream os(filepath);
+	if (!os.good())
+		ERROR("Cannot open file " << filepath);
+
+	os << "{\n"
+		<< "\t\"image_size\": [" << image_size.X << ", " << image_size.Y << "],\n"
+		<< "\t\"tiles\": [" << n_tiles.X << ", " << n_tiles.Y << "],\n"
+		<< "\t\"quality\": { \"fragments\": " << quality.fragments
+		<< ", \"largest\": " << quality.largest
+		<< ", \"links\": " << quality.links
+		<< ", \"mean_diff\": " << quality.mean_diff << " },\n"
+		<< "\t\"placement\": [";
+
+	for (size_t n = 0; n < entries.size(); ++n) {
+		const Entry &entry = entries[n];
+		os << (n ? ",\n" : "\n")
+			<< "\t\t{ \"from\": [" << entry.place.original.X << ", "
+			<< entry.place.original.Y << "], \"to\": ["
+			<< entry.place.pos.X << ", " << entry.place.pos.Y << "], "
+			<< "\"edges\": [";
+
+		// left, top, right, bottom
+		for (int i = 0; i < TP_TOTAL; ++i) {
+			if (i)
+				os << ", ";
+			if (entry.edges[i] == NO_EDGE)
+				os << "null";
+			else
+				os << entry.edges[i];
+		}
+		os << "] }";
+	}
+	os << "\n\t]\n}\n";
+}
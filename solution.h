@@ -0,0 +1,39 @@
+#pragma once
+
+#include "image.h"
+#include "puzzle.h"
+#include "tile.h"
+#include <string>
+#include <vector>
+
+// Result of a solved puzzle: target position of each source tile and the
+// face distance to each linked neighbour. Enough to reassemble the image.
+class Solution {
+public:
+	// No link on this face
+	static const uint16_t NO_EDGE = 0xFFFF;
+
+	struct Entry {
+		TilePlacement place;
+		uint16_t edges[TP_TOTAL]; // in TILE_POS order
+	};
+
+	// Reads the placement from puzzle.mapdata (see Tile::sortAllUnsafe)
+	void fromPuzzle(Puzzle &puzzle, const v2u32 &image_size, const v2u32 &n_tiles);
+	void getPlacement(std::vector<TilePlacement> &out) const;
+
+	// Compact little-endian format, see solution.cpp
+	void saveBinary(const std::string &filepath) const;
+	// Rejects files that do not fit their own tile grid
+	void loadBinary(const std::string &filepath);
+	void saveJSON(const std::string &filepath) const;
+
+	// Unique tiles on the source grid, placed within a bounded area
+	bool isValid() const;
+
+	v2u32 image_size;
+	v2u32 n_tiles;
+	std::vector<Entry> entries;
+	// Only written to JSON
+	SolveQuality quality;
+};
@@ -1,50 +1,26 @@
 #include "tile.h"
+#include "puzzle.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
-std::unordered_map<Tile *, v2s16> *g_mapdata =
-	new std::unordered_map<Tile *, v2s16>();
-std::vector<Tile *> g_pool;
-
-
-v2s16 tile_pos_to_dir[TP_TOTAL] = {
-	v2s16(-1, 0), v2s16(0, -1), v2s16(1, 0), v2s16(0, 1) 
+v2s32 tile_pos_to_dir[TP_TOTAL] = {
+	v2s32(-1, 0), v2s32(0, -1), v2s32(1, 0), v2s32(0, 1) 
 };
 
-int Tile::s_seen_max = 1;
-
-int Face::getDistance(const Face &other) const
-{
-	int diff = 0;
-	for (int i = 0; i < SEGNUM; ++i)
-		diff += ABS(colors[i] - other.colors[i]);
-
-	/*int variety = 0;
-	for (int i = 0; i < SEGNUM - 1; ++i)
-		variety += ABS(colors[i] - colors[i + 1]);*/
-
-	diff += ((int)512 - other.variance - variance);
-
-	if (diff < 0)
-		diff = 0;
-
-	return diff;
-}
-
-Tile::Tile(const v2u16 &tilepos, const v2u16 &original)
+Tile::Tile(Puzzle *puzzle, const v2u32 &original, uint32_t index) :
+	index(index), m_puzzle(puzzle)
 {
 	original_pos = original;
 
 	for (int i = 0; i < TP_TOTAL; ++i)
-		neighbours[i] = nullptr;
+		neighbours[i] = TILE_NONE;
 	link_count = 0;
 }
 
-Tile *Tile::getAtPos(const v2s16 &pos)
+Tile *Tile::getAtPos(Puzzle &puzzle, const v2s32 &pos)
 {
-	for (auto &it : *g_mapdata) {
-		if (it.second == pos)
-			return it.first;
-	}
-	return nullptr;
+	return puzzle.mapdata.getAt(pos);
 }
 
 bool Tile::link(Tile *other, TILE_POS face)
@@ -53,36 +29,31 @@ bool Tile::link(Tile *other, TILE_POS face)
 	if (face == TP_TOTAL)
 		return false;
 
-	if (neighbours[face] == other)
+	if (getNeighbour(face) == other)
 		return true;
 
 	// Unlink previous neighbour
 	unlink(face);
 
 	TILE_POS o_face = swapTilePos(face);
-	if (other->neighbours[o_face]) {
+	if (Tile *conflict = other->getNeighbour(o_face)) {
 		WARN("CONFLICT: " << PP(other->original_pos)
-			<< " already linked with " << PP(other->neighbours[o_face]->original_pos));
+			<< " already linked with " << PP(conflict->original_pos));
 	
 		other->unlink(o_face);
 		return false;
 	}
 
-	// Link with new neighbour
-	neighbours[face] = other;
-	link_count++;
-
-	other->neighbours[o_face] = this;
-	other->link_count++;
-
-	g_mapdata->clear();
-	if (!makeMap(v2s16())) {
+	if (!m_puzzle->fragments.merge(this, other, face)) {
 		VERBOSE("Failed to link " << PP(other->original_pos)
 			<< " to " << PP(original_pos) << " (not planar)");
-		unlink(face);
 		return false;
 	}
 
+	// Link with new neighbour
+	setNeighbour(face, other);
+	other->setNeighbour(o_face, this);
+
 	VERBOSE("Link face=" << (int)face << ", len=" << getWeight() << std::endl
 		<< "\t" << PP(original_pos) << " ---> " << PP(other->original_pos));
 	checkLinks();
@@ -95,32 +66,42 @@ bool Tile::unlink(TILE_POS face)
 	if (face == TP_TOTAL)
 		return false;
 
-	Tile *other = neighbours[face];
+	Tile *other = getNeighbour(face);
 	if (!other)
 		return false;
 
 	TILE_POS o_face = swapTilePos(face);
-	if (!other->neighbours[o_face]) {
+	if (!other->getNeighbour(o_face)) {
 		ERROR("Neighbour face=" << (int)face
 			<< " not linked with " << PP(original_pos));
 	}
 
-	other->neighbours[o_face] = nullptr;
-	other->link_count--;
-	neighbours[face] = nullptr;
-	link_count--;
+	other->setNeighbour(o_face, nullptr);
+	setNeighbour(face, nullptr);
+
+	m_puzzle->fragments.split(this, other);
 
 	checkLinks();
 	other->checkLinks();
 	return true;
 }
 
+void Tile::setNeighbour(TILE_POS face, Tile *tile)
+{
+	if (m_puzzle->isRecording())
+		m_puzzle->m_journal.push_back(Puzzle::JournalEntry { index, face, neighbours[face] });
+
+	uint32_t next = tile ? tile->index : TILE_NONE;
+	link_count += (next != TILE_NONE) - (neighbours[face] != TILE_NONE);
+	neighbours[face] = next;
+}
+
 void Tile::checkLinks()
 {
 	int old_count = link_count;
 	link_count = 0;
 	for (int i = 0; i < TP_TOTAL; ++i) {
-		if (!neighbours[i])
+		if (neighbours[i] == TILE_NONE)
 			continue;
 
 		link_count++;
@@ -138,31 +119,48 @@ int Tile::getDistance(Tile *other, TILE_POS *best_match) const
 {
 	int d, diff = 0xFFFF;
 
+	int dist[TP_TOTAL];
+	const CompatMatrix &compat = m_puzzle->compat;
+	if (!compat.empty()) {
+		const uint16_t *precomputed = compat.get(index, other->index);
+		for (int i = 0; i < TP_TOTAL; ++i)
+			dist[i] = precomputed[i];
+	} else {
+		Face mine_f[TP_TOTAL], theirs_f[TP_TOTAL];
+		const Face *mine[TP_TOTAL], *theirs[TP_TOTAL];
+		for (int i = 0; i < TP_TOTAL; ++i) {
+			mine_f[i] = getFace((TILE_POS)i);
+			theirs_f[i] = other->getFace(swapTilePos(i));
+			mine[i] = &mine_f[i];
+			theirs[i] = &theirs_f[i];
+		}
+		Face::getDistance4(mine, theirs, dist);
+	}
+
 	for (int i = 0; i < TP_TOTAL; ++i) {
 #if 0
-		if (neighbours[i] && neighbours[i] != other)
+		if (getNeighbour((TILE_POS)i) && getNeighbour((TILE_POS)i) != other)
 			continue;
 
 		TILE_POS o_face = swapTilePos(i);
-		if (other->neighbours[o_face] && other->neighbours[o_face] != this)
+		if (other->getNeighbour(o_face) && other->getNeighbour(o_face) != this)
 			continue;
 #else
-		if (neighbours[i])
+		if (neighbours[i] != TILE_NONE)
 			continue;
 		TILE_POS o_face = swapTilePos(i);
-		if (other->neighbours[o_face])
+		if (other->neighbours[o_face] != TILE_NONE)
 			continue;
 #endif
-	
-		d = faces[i].getDistance(other->faces[o_face]);
+		d = dist[i];
 
 		if (d < diff) {
 			diff = d;
 			*best_match = (TILE_POS)i;
 		}
 	}
-	/*if (original_pos == v2u16(128, 192)// (136, 192)
-		&& other->original_pos == v2u16(192, 896)
+	/*if (original_pos == v2u32(128, 192)// (136, 192)
+		&& other->original_pos == v2u32(192, 896)
 	) {
 		LOG("match: " << (int)*best_match << " diff = " << diff);
 		getchar();
@@ -176,24 +174,22 @@ int Tile::getDistance(Tile *other, TILE_POS *best_match) const
 	return diff;
 }
 
-Tile *Tile::getNeighbour(TILE_POS face)
-{
-	if (face == TP_TOTAL)
-		ERROR("Wrong face");
-
-	return neighbours[face];
-}
-
-int Tile::getDistanceAll() const
+int Tile::getDistanceAll(const Tile *with, TILE_POS face) const
 {
 	int d = 0;
 	int n = 0;
 
+	if (with) {
+		d += getFace(face).getDistance(with->getFace(swapTilePos(face)));
+		n++;
+	}
+
 	for (int i = 0; i < TP_TOTAL; ++i) {
-		if (!neighbours[i])
+		Tile *other = getNeighbour((TILE_POS)i);
+		if (!other)
 			continue;
 
-		d += faces[i].getDistance(neighbours[i]->faces[swapTilePos(i)]);
+		d += getFace((TILE_POS)i).getDistance(other->getFace(swapTilePos(i)));
 		n++;
 	}
 	if (n == 0)
@@ -202,47 +198,24 @@ int Tile::getDistanceAll() const
 	return d / n;
 }
 
-int Tile::recursiveExecS(tilecall_t func)
-{
-	if (m_seen > s_seen_max)
-		ERROR("Seen counter exceeds limits! diff=" << m_seen - s_seen_max);
-
-	if (m_seen == s_seen_max)
-		return 0;
-	m_seen = s_seen_max;
-
-	int executed = 1;
-	if (func)
-		func(this);
-
-	for (int i = 0; i < TP_TOTAL; ++i) {
-		if (neighbours[i])
-			executed += neighbours[i]->recursiveExecS(func);
-	}
-	return executed;
-}
-
 int Tile::getWeight()
 {
-	pushSeen();
-	int n = recursiveExecS(nullptr);
-	popSeen();
-	return n;
+	return m_puzzle->fragments.getSize(this);
 }
 
-int Tile::getDimensions(v2s16 &dim_min, v2s16 &dim_max)
+int Tile::getDimensions(const TileMap &map, v2s32 &dim_min, v2s32 &dim_max)
 {
-	dim_min = v2s16(0x7FFF, 0x7FFF);
-	dim_max = v2s16(-0x7FFF, -0x7FFF);
+	dim_min = v2s32(INT32_MAX, INT32_MAX);
+	dim_max = v2s32(INT32_MIN, INT32_MIN);
 
-	tilecall_t f_measure = [&] (Tile *tile) {
-		auto it = g_mapdata->find(tile);
-		if (it == g_mapdata->end()) {
-			Tile::dumpMap();
+	auto f_measure = [&] (Tile *tile) {
+		const v2s32 *mapped = map.getPos(tile);
+		if (!mapped) {
+			Tile::dumpMap(map);
 			ERROR("Tile not in map: " << PP(tile->original_pos));
 		}
 
-		const v2s16 &pos = it->second;
+		const v2s32 &pos = *mapped;
 		if (pos.X > dim_max.X)
 			dim_max.X = pos.X;
 		if (pos.Y > dim_max.Y)
@@ -254,100 +227,102 @@ int Tile::getDimensions(v2s16 &dim_min, v2s16 &dim_max)
 			dim_min.Y = pos.Y;
 	};
 
-	pushSeen();
-	int n = recursiveExecS(f_measure); // SEEN
-	popSeen();
+	m_puzzle->pushSeen();
+	int n = execS(f_measure); // SEEN
+	m_puzzle->popSeen();
 	return n;
 }
 
-bool Tile::makeMap(v2s16 pos)
+bool Tile::makeMap(TileMap &map, v2s32 pos)
 {
-	auto it = g_mapdata->find(this);
-	if (it != g_mapdata->end())
-		return it->second == pos;
-
-	for (auto &it : *g_mapdata) {
-		if (it.second == pos)
-			return false;
-	}
-	g_mapdata->insert(std::pair<Tile *, v2s16>(this, pos));
-
-	for (int i = 0; i < TP_TOTAL; ++i) {
-		if (!neighbours[i])
+	std::vector<std::pair<Tile *, v2s32>> stack;
+	stack.emplace_back(this, pos);
+
+	while (!stack.empty()) {
+		Tile *tile = stack.back().first;
+		pos = stack.back().second;
+		stack.pop_back();
+
+		const v2s32 *mapped = map.getPos(tile);
+		if (mapped) {
+			if (*mapped != pos)
+				return false;
 			continue;
+		}
 
-		if (!neighbours[i]->makeMap(pos + tile_pos_to_dir[i]))
+		if (!map.insert(tile, pos))
 			return false;
+
+		for (int i = TP_TOTAL - 1; i >= 0; --i) {
+			if (Tile *next = tile->getNeighbour((TILE_POS)i))
+				stack.emplace_back(next, pos + tile_pos_to_dir[i]);
+		}
 	}
 	return true;
 }
 
-void Tile::dumpMap()
+void Tile::dumpMap(const TileMap &map)
 {
-	std::cout << "==== Map dump: " << g_mapdata->size() << " entries" << std::endl;
-	for (auto &it : *g_mapdata) {
+	std::cout << "==== Map dump: " << map.size() << " entries" << std::endl;
+	for (auto &it : map) {
 		std::cout << PP(it.second) << " <-- "
 			<< PP(it.first->original_pos) << std::endl;
 	}
 }
 
-int Tile::sortAllUnsafe(Tile *&center)
+int Tile::sortAllUnsafe(Puzzle &puzzle, Tile *&center)
 {
+	TileMap &map = puzzle.mapdata;
 	int max_length = 0;
 
 	// Find the longest chain
-	pushSeen();
-	for (Tile *tile : g_pool) {
-		int n = tile->recursiveExecS(nullptr); // SEEN
+	puzzle.pushSeen();
+	for (Tile *tile : puzzle.pool) {
+		int n = tile->execS(); // SEEN
 		if (n > max_length) {
 			center = tile;
 			max_length = n;
 		}
 	}
-	popSeen();
+	puzzle.popSeen();
 
-	g_mapdata->clear();
-	bool ok = center->makeMap(v2s16());
+	map.clear();
+	bool ok = center->makeMap(map, v2s32());
 	if (!ok)
 		WARN("Map collision");
-	//Tile::dumpMap();
+	//Tile::dumpMap(map);
 
-	v2s16 dim_min, dim_max;
-	center->getDimensions(dim_min, dim_max);
+	v2s32 dim_min, dim_max;
+	center->getDimensions(map, dim_min, dim_max);
 
 	// Remove offsets
-	pushSeen();
-	center->recursiveExecS([&](Tile *tile) {
-		auto it = g_mapdata->find(tile);
-		it->second = it->second - dim_min;
-	});
+	map.translate(v2s32() - dim_min);
 	dim_max = dim_max - dim_min;
-	dim_min = v2s16();
-	popSeen();
+	dim_min = v2s32();
 
-	const int SPACE = 3;
-	pushSeen();
-	center->recursiveExecS(nullptr); // already mapped
+	const int SPACE = SORT_SPACE;
+	puzzle.pushSeen();
+	center->execS(); // already mapped
 	dim_max.X += SPACE;
-	for (Tile *tile : g_pool) {
+	TileMap adj_map;
+	for (Tile *tile : puzzle.pool) {
 		if (tile->getSeenDiff() == 0)
 			continue; // seen
 
-		auto *real_map = g_mapdata;
-		g_mapdata = new std::unordered_map<Tile *, v2s16>();
-		tile->makeMap(v2s16());
+		adj_map.clear();
+		tile->makeMap(adj_map, v2s32());
 
-		v2s16 adj_min, adj_max;
-		tile->getDimensions(adj_min, adj_max);
+		v2s32 adj_min, adj_max;
+		tile->getDimensions(adj_map, adj_min, adj_max);
 
-		// Append positions to the sides of "real_map"
-		for (auto &it : *g_mapdata) {
-			it.second = v2s16(
+		// Append positions to the sides of the main map
+		for (auto &it : adj_map) {
+			v2s32 pos(
 				it.second.X - adj_min.X + dim_max.X,
 				it.second.Y - adj_min.Y + dim_min.Y
 			);
-			VERBOSE(PP(it.second));
-			real_map->insert(it);
+			VERBOSE(PP(pos));
+			map.insert(it.first, pos);
 		}
 		dim_max.X += SPACE + (adj_max.X - adj_min.X);
 		// Find taller one
@@ -359,13 +334,9 @@ int Tile::sortAllUnsafe(Tile *&center)
 			dim_max.X = 0;
 			dim_max.Y = 0;
 		}
-
-		delete g_mapdata;
-		g_mapdata = real_map;
 	}
-	dim_max.Y += dim_min.Y;
-	dim_min = v2s16();
-	popSeen();
+	puzzle.popSeen();
+	map.getBounds(dim_min, dim_max);
 
 	LOG("Longest: " << max_length << std::endl
 		<< "\tmin=" << PP(dim_min)
@@ -373,14 +344,58 @@ int Tile::sortAllUnsafe(Tile *&center)
 	return max_length;
 }
 
-void Tile::popSeen()
+TileStore::~TileStore()
 {
-	if (!s_seen_max)
-		ERROR("Seen == 0");
+	free(m_colors);
+	free(m_variance);
+}
 
-	for (Tile *tile : g_pool) {
-		if (tile->m_seen == s_seen_max)
-			--tile->m_seen;
+void TileStore::reset(size_t capacity)
+{
+	m_tiles.clear();
+
+	if (capacity <= m_capacity)
+		return;
+
+	free(m_colors);
+	free(m_variance);
+
+	// aligned_alloc requires a multiple of the alignment
+	size_t faces = capacity * TP_TOTAL;
+	m_colors = (uint8_t *)aligned_alloc(64, (faces * SEGNUM + 63) & ~(size_t)63);
+	m_variance = (uint8_t *)malloc(faces);
+	if (!m_colors || !m_variance)
+		ERROR("Out of memory");
+
+	m_tiles.reserve(capacity);
+	m_capacity = capacity;
+}
+
+void TileStore::updateVariance(uint32_t tile)
+{
+	for (int i = 0; i < TP_TOTAL; ++i) {
+		const uint8_t *colors = getColors(tile, (TILE_POS)i);
+		uint8_t min = 0xFF, max = 0;
+
+		for (int j = 0; j < SEGNUM; ++j) {
+			min = std::min(min, colors[j]);
+			max = std::max(max, colors[j]);
+		}
+
+		getVariance(tile, (TILE_POS)i) = max - min;
 	}
-	s_seen_max--;
+}
+
+Tile *TileStore::add(const v2u32 &original)
+{
+	// Pointers to the tiles must stay valid
+	if (m_tiles.size() >= m_capacity)
+		ERROR("TileStore is full");
+
+	uint32_t index = m_tiles.size();
+	m_tiles.emplace_back(m_puzzle, original, index);
+
+	memset(getColors(index, TP_LEFT), 0, TP_TOTAL * SEGNUM);
+	memset(&getVariance(index, TP_LEFT), 0, TP_TOTAL);
+	return &m_tiles.back();
 }
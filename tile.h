@@ -1,15 +1,13 @@
 #pragma once
 
 #include "headers.h"
-#include <functional>
+#include "tilemap.h"
 #include <unordered_map>
 #include <vector>
 
 #define SEGNUM 16
 
-class Tile;
-extern std::unordered_map<Tile *, v2s16> *g_mapdata;
-extern std::vector<Tile *> g_pool;
+class Puzzle;
 
 
 enum TILE_POS : uint8_t {
@@ -20,60 +18,143 @@ enum TILE_POS : uint8_t {
 	TP_TOTAL
 };
 
-extern v2s16 tile_pos_to_dir[TP_TOTAL];
+extern v2s32 tile_pos_to_dir[TP_TOTAL];
 
 inline TILE_POS swapTilePos(int pos)
 {
 	return (TILE_POS)((pos + 2) & (TP_TOTAL - 1));
 }
 
-typedef std::function<void(Tile *)> tilecall_t;
+class Face;
 
+// Face comparison kernels. The best one supported by the CPU is picked
+// once on startup, see Face::getKernels()
+struct FaceKernel {
+	const char *name;
+	int (*distance)(const Face &a, const Face &b);
+	// Four pairs at once: out[i] = distance(*a[i], *b[i])
+	void (*distance4)(const Face *const a[4], const Face *const b[4], int out[4]);
+};
+
+// Read-only view of one tile face, see TileStore::getFace
 class Face {
 public:
-	int getDistance(const Face &other) const;
+	inline int getDistance(const Face &other) const
+	{ return s_kernel->distance(*this, other); }
+
+	static void getDistance4(const Face *const a[4], const Face *const b[4], int out[4])
+	{ s_kernel->distance4(a, b, out); }
+
+	// All kernels supported by this CPU, scalar reference first
+	static std::vector<const FaceKernel *> getKernels();
+	static const FaceKernel *getKernel() { return s_kernel; }
 
-	uint8_t colors[SEGNUM];
+	const uint8_t *colors; // SEGNUM values
 	uint8_t variance;
+
+private:
+	static const FaceKernel *s_kernel;
 };
 
 class Tile {
 public:
-	Tile(const v2u16 &tilepos, const v2u16 &original);
+	Tile(Puzzle *puzzle, const v2u32 &original, uint32_t index);
 
-	static Tile *getAtPos(const v2s16 &pos);
+	static Tile *getAtPos(Puzzle &puzzle, const v2s32 &pos);
 
 	// out: link successful?
 	bool link(Tile *other, TILE_POS face);
 	bool unlink(TILE_POS face);
 
 	int getDistance(Tile *other, TILE_POS *best_match) const;
-	Tile *getNeighbour(TILE_POS face);
-	int getDistanceAll() const;
-
-	int recursiveExecS(tilecall_t func);
+	inline Tile *getNeighbour(TILE_POS face) const;
+	inline Face getFace(TILE_POS face) const;
+	// Mean distance to all neighbours. Optionally includes "with" as if it
+	// were linked at "face" (which must be free). Read-only.
+	int getDistanceAll(const Tile *with = nullptr, TILE_POS face = TP_TOTAL) const;
+
+	// Calls "func" for each linked tile that was not seen yet by the
+	// current traversal level (see Puzzle::pushSeen). Depth-first, without recursion.
+	// out: number of visited tiles
+	template<typename F>
+	int execS(F func);
+	inline int execS();
 	int getWeight();
-	int getDimensions(v2s16 &dim_min, v2s16 &dim_max);
-	bool makeMap(v2s16 pos);
-	static void dumpMap();
-	static int sortAllUnsafe(Tile *&center);
+	int getDimensions(const TileMap &map, v2s32 &dim_min, v2s32 &dim_max);
+	bool makeMap(TileMap &map, v2s32 pos);
+	static void dumpMap(const TileMap &map);
+	static int sortAllUnsafe(Puzzle &puzzle, Tile *&center);
+	// Free tiles between the fragments placed by sortAllUnsafe
+	static const int SORT_SPACE = 3;
 
 	// 0 = neighbour/myself
-	// 1 = from previous recursive action
-	inline bool getSeenDiff() const { return s_seen_max - m_seen; };
-	static void pushSeen() { ++s_seen_max; }
-	static void popSeen();
+	// 1 = from previous traversal
+	inline bool getSeenDiff() const;
 
-	v2u16 original_pos;
-
-	Face faces[TP_TOTAL];
+	v2u32 original_pos;
+	uint32_t index; // in Puzzle::pool
 	int link_count;
 
 private:
-	static int s_seen_max;
+	friend class Puzzle;
 
+	void setNeighbour(TILE_POS face, Tile *tile);
 	void checkLinks();
 
-	Tile *neighbours[TP_TOTAL];
-	int m_seen = false;
+	Puzzle *m_puzzle;
+	uint32_t neighbours[TP_TOTAL]; // index in Puzzle::pool or TILE_NONE
+	uint64_t m_seen = 0;
+};
+
+#define TILE_NONE UINT32_MAX
+
+// Owns all tiles of the puzzle in one contiguous arena.
+// The face data is kept separately as structure of arrays: all colors
+// in one aligned block (SEGNUM bytes per face), then all variances.
+class TileStore {
+public:
+	TileStore(Puzzle *puzzle) : m_puzzle(puzzle) {}
+	TileStore(const TileStore &) = delete;
+	~TileStore();
+
+	// Drops all tiles in O(1). Memory is only reallocated when growing.
+	void reset(size_t capacity);
+	Tile *add(const v2u32 &original);
+
+	inline size_t size() const { return m_tiles.size(); }
+	inline Tile *operator[](size_t i) { return &m_tiles[i]; }
+	inline const Tile *operator[](size_t i) const { return &m_tiles[i]; }
+
+	inline uint8_t *getColors(uint32_t tile, TILE_POS face)
+	{ return &m_colors[((size_t)tile * TP_TOTAL + face) * SEGNUM]; }
+	inline uint8_t &getVariance(uint32_t tile, TILE_POS face)
+	{ return m_variance[(size_t)tile * TP_TOTAL + face]; }
+	// Color range of each face. Call once its colors are complete.
+	void updateVariance(uint32_t tile);
+	inline Face getFace(uint32_t tile, TILE_POS face) const
+	{
+		size_t i = (size_t)tile * TP_TOTAL + face;
+		return Face { &m_colors[i * SEGNUM], m_variance[i] };
+	}
+
+	// Iterates over Tile pointers, like the previous std::vector<Tile *>
+	class iterator {
+	public:
+		iterator(Tile *tile) : m_tile(tile) {}
+		inline Tile *operator*() const { return m_tile; }
+		inline iterator &operator++() { ++m_tile; return *this; }
+		inline bool operator!=(const iterator &other) const
+		{ return m_tile != other.m_tile; }
+	private:
+		Tile *m_tile;
+	};
+	iterator begin() { return iterator(m_tiles.data()); }
+	iterator end() { return iterator(m_tiles.data() + m_tiles.size()); }
+
+private:
+	Puzzle *m_puzzle;
+	std::vector<Tile> m_tiles;
+	uint8_t *m_colors = nullptr; // 64-byte aligned
+	uint8_t *m_variance = nullptr;
+	size_t m_capacity = 0;
 };
@@ -0,0 +1,68 @@
+#include "tilemap.h"
+#include <algorithm>
+
+void TileMap::clear()
+{
+	m_pos.clear();
+	m_tiles.clear();
+}
+
+void TileMap::reserve(size_t n)
+{
+	m_pos.reserve(n);
+	m_tiles.reserve(n);
+}
+
+bool TileMap::insert(Tile *tile, const v2s32 &pos)
+{
+	const v2s32 *mapped = getPos(tile);
+	if (mapped)
+		return *mapped == pos;
+
+	if (!m_tiles.insert({ pos.getHash(), tile }).second)
+		return false;
+
+	m_pos[tile] = pos;
+	return true;
+}
+
+void TileMap::translate(const v2s32 &offset)
+{
+	m_tiles.clear();
+	for (auto &it : m_pos) {
+		it.second = it.second + offset;
+		m_tiles[it.second.getHash()] = it.first;
+	}
+}
+
+bool TileMap::getBounds(v2s32 &dim_min, v2s32 &dim_max) const
+{
+	if (m_pos.empty())
+		return false;
+
+	dim_min = dim_max = m_pos.begin()->second;
+	for (auto &it : m_pos) {
+		const v2s32 &pos = it.second;
+		dim_min.X = std::min(dim_min.X, pos.X);
+		dim_min.Y = std::min(dim_min.Y, pos.Y);
+		dim_max.X = std::max(dim_max.X, pos.X);
+		dim_max.Y = std::max(dim_max.Y, pos.Y);
+	}
+	return true;
+}
+
+const v2s32 *TileMap::getPos(Tile *tile) const
+{
+	auto it = m_pos.find(tile);
+	if (it == m_pos.end())
+		return nullptr;
+	return &it->second;
+}
+
+Tile *TileMap::getAt(const v2s32 &pos) const
+{
+	auto it = m_tiles.find(pos.getHash());
+	if (it == m_tiles.end())
+		return nullptr;
+	return it->second;
+}
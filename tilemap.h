@@ -0,0 +1,35 @@
+#pragma once
+
+#include "headers.h"
+#include <unordered_map>
+
+class Tile;
+
+// Placement of tiles on the 2D map.
+// Keeps both directions indexed: tile -> position and position -> tile
+class TileMap {
+public:
+	typedef std::unordered_map<Tile *, v2s32>::const_iterator const_iterator;
+
+	void clear();
+	void reserve(size_t n);
+	inline size_t size() const { return m_pos.size(); }
+
+	// out: false if the position is already taken
+	bool insert(Tile *tile, const v2s32 &pos);
+	// Moves all tiles by "offset"
+	void translate(const v2s32 &offset);
+	// Smallest and largest mapped position. false if empty
+	bool getBounds(v2s32 &dim_min, v2s32 &dim_max) const;
+
+	// nullptr if not mapped
+	const v2s32 *getPos(Tile *tile) const;
+	Tile *getAt(const v2s32 &pos) const;
+
+	const_iterator begin() const { return m_pos.begin(); }
+	const_iterator end() const { return m_pos.end(); }
+
+private:
+	std::unordered_map<Tile *, v2s32> m_pos;
+	std::unordered_map<unsigned long long, Tile *> m_tiles;
+};
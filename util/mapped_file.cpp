@@ -0,0 +1,58 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const std::string &filepath)
+{
+	close();
+
+	bool is_stdin = filepath == "-";
+	int fd = is_stdin ? STDIN_FILENO : ::open(filepath.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			m_data = (uint8_t *)addr;
+			m_size = st.st_size;
+			m_mapped = true;
+		}
+	}
+
+	// Fallback for pipes and special files
+	if (!m_mapped) {
+		uint8_t chunk[64 * 1024];
+		ssize_t n;
+		while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+			m_buffer.insert(m_buffer.end(), chunk, chunk + n);
+
+		m_data = m_buffer.data();
+		m_size = m_buffer.size();
+	}
+
+	if (!is_stdin)
+		::close(fd);
+	return m_size > 0;
+}
+
+void MappedFile::close()
+{
+	if (m_mapped)
+		munmap(m_data, m_size);
+
+	m_buffer.clear();
+	m_buffer.shrink_to_fit();
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Entire file contents, mapped into memory where possible.
+// Pipes and "-" (stdin) are read into a buffer instead.
+// Read-only, see Image::copyPixels for a writable copy.
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	~MappedFile();
+
+	bool open(const std::string &filepath);
+	void close();
+
+	inline const uint8_t *data() const { return m_data; }
+	inline size_t size() const { return m_size; }
+
+private:
+	uint8_t *m_data = nullptr;
+	size_t m_size = 0;
+	bool m_mapped = false;
+	std::vector<uint8_t> m_buffer;
+};
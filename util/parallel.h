@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use for parallel passes
+inline unsigned getThreadCount()
+{
+	unsigned n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
+
+// Threads a parallelFor call on this thread may use, 0 for all cores.
+// A nested call gets the share of its outer thread, so that e.g. one puzzle
+// per file does not start cores x cores threads.
+inline unsigned &getThreadBudget()
+{
+	static thread_local unsigned budget = 0;
+	return budget;
+}
+
+// Runs func(job) for each job in [0, n_jobs) on all cores.
+// Jobs are handed out dynamically, so uneven jobs balance themselves.
+template<typename F>
+void parallelFor(size_t n_jobs, F func)
+{
+	unsigned budget = getThreadBudget() ? getThreadBudget() : getThreadCount();
+	unsigned n_threads = std::min<size_t>(budget, n_jobs);
+	if (n_threads <= 1) {
+		for (size_t i = 0; i < n_jobs; ++i)
+			func(i);
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	auto worker = [&] (unsigned share) {
+		unsigned outer = getThreadBudget();
+		getThreadBudget() = share;
+
+		size_t i;
+		while ((i = next++) < n_jobs)
+			func(i);
+
+		getThreadBudget() = outer;
+	};
+
+	// Split the budget among the threads, the remainder goes to the first ones
+	std::vector<std::thread> threads;
+	threads.reserve(n_threads - 1);
+	for (unsigned t = 1; t < n_threads; ++t)
+		threads.emplace_back(worker, budget / n_threads + (t < budget % n_threads));
+
+	worker(budget / n_threads + (budget % n_threads > 0));
+	for (std::thread &t : threads)
+		t.join();
+}
@@ -36,3 +36,23 @@ private:
 	std::chrono::time_point<std::chrono::_V2::steady_clock,
 		std::chrono::nanoseconds> m_start, m_last;
 };
+
+// Wall-clock limit for anytime solving
+class Deadline {
+public:
+	// 0 ms: never expires
+	Deadline(long ms = 0) : m_enabled(ms > 0)
+	{
+		m_end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	}
+
+	inline bool expired() const
+	{
+		return m_enabled && std::chrono::steady_clock::now() >= m_end;
+	}
+	inline bool enabled() const { return m_enabled; }
+
+private:
+	bool m_enabled;
+	std::chrono::steady_clock::time_point m_end;
+};
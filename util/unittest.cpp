@@ -1,25 +1,148 @@
 #include "unittest.h"
+#include "beamsolver.h"
+#include "heapsolver.h"
 #include "image.h"
 #include "headers.h"
-#include "tile.h"
+#include "puzzle.h"
+#include "snapshot.h"
+#include "solution.h"
+#include "util/parallel.h"
 
 #include <algorithm> // std::sort
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <unistd.h>
 #include <vector>
 
 const char *testfile = "images/simple.png";
 
+// Creates an empty temporary file. To be removed by the caller.
+static std::string makeTempFile()
+{
+	const char *dir = getenv("TMPDIR");
+	std::string path = std::string(dir && *dir ? dir : "/tmp") + "/earthstar_XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd < 0)
+		ERROR("Cannot create a temporary file in " << path);
+	close(fd);
+	return path;
+}
+
+static std::string writeTempFile(const std::string &header, const std::vector<uint8_t> &data)
+{
+	std::string path = makeTempFile();
+	std::ofstream file(path, std::ios::binary);
+	file << header;
+	file.write((const char *)data.data(), data.size());
+	return path;
+}
+
+// Decodes a PNG file to 8-bit RGB
+static std::vector<uint8_t> decodePNG(const std::string &path, v2u32 &size)
+{
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	ASSERT(png_image_begin_read_from_file(&image, path.c_str()));
+	image.format = PNG_FORMAT_RGB;
+
+	std::vector<uint8_t> pixels(PNG_IMAGE_SIZE(image));
+	ASSERT(png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr));
+	size = v2u32(image.width, image.height);
+	return pixels;
+}
+
+// Inflates the concatenated IDAT chunks, including the Adler-32 check
+// out: filtered image data, empty if the stream is broken or incomplete
+static std::vector<uint8_t> inflateIDAT(const std::string &path)
+{
+	std::ifstream file(path, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	std::string idat;
+	for (size_t pos = 8; pos + 12 <= data.size(); ) {
+		const uint8_t *head = (const uint8_t *)&data[pos];
+		size_t len = ((size_t)head[0] << 24) | (head[1] << 16) | (head[2] << 8) | head[3];
+		if (data.compare(pos + 4, 4, "IDAT") == 0)
+			idat.append(data, pos + 8, len);
+		pos += len + 12;
+	}
+
+	std::vector<uint8_t> out(16 * 1024 * 1024);
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	inflateInit(&zs);
+	zs.next_in = (Bytef *)&idat[0];
+	zs.avail_in = idat.size();
+	zs.next_out = out.data();
+	zs.avail_out = out.size();
+	int status = inflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	inflateEnd(&zs);
+
+	if (status != Z_STREAM_END || zs.avail_in != 0)
+		out.clear();
+	return out;
+}
+
+// All tiles spread over 10x10 tile units, with gaps and negative positions
+static std::vector<TilePlacement> getTestPlacement(Puzzle &puzzle)
+{
+	std::vector<TilePlacement> placed;
+	for (Tile *tile : puzzle.pool) {
+		int32_t i = puzzle.pool.size() - 1 - tile->index;
+		placed.push_back({ tile->original_pos, v2s32(i % 4 * 3 - 2, i / 4 * 3 - 5) });
+	}
+	return placed;
+}
+
+// Both have the same tiles with the same face descriptors
+static bool isSameFaces(Puzzle &a, Puzzle &b)
+{
+	if (a.pool.size() != b.pool.size())
+		return false;
+
+	for (size_t i = 0; i < a.pool.size(); ++i) {
+		Tile *ta = a.pool[i], *tb = b.pool[i];
+		if (ta->original_pos != tb->original_pos)
+			return false;
+
+		for (int face = 0; face < TP_TOTAL; ++face) {
+			Face fa = ta->getFace((TILE_POS)face),
+				fb = tb->getFace((TILE_POS)face);
+			if (fa.variance != fb.variance || memcmp(fa.colors, fb.colors, SEGNUM))
+				return false;
+		}
+	}
+	return true;
+}
+
 
 Unittest::Unittest()
 {
+	m_puzzle = new Puzzle();
 	m_img = new Image(testfile);
-	m_img->read(v2u16(4, 4));
-	m_img->smoothen();
+	m_img->read(*m_puzzle, v2u32(4, 4));
+	m_puzzle->compat.build(m_puzzle->pool);
 
+	checkKernels();
+	checkParallelBudget();
+	checkFragments();
+	checkRanking();
+	checkSolvers();
+	checkInputFormats();
+	checkStreamed();
+	checkParallelPNG();
+	checkBanded();
+	checkSolutionFile();
+	checkSnapshotLayout();
 	checkSimilar();
 	similarOverall();
 	moveLink();
 
-	updateImage(m_img, false);
+	updateImage(*m_puzzle, m_img, false);
 
 	//closestMatchLoop(img);
 
@@ -29,44 +152,510 @@ Unittest::Unittest()
 Unittest::~Unittest()
 {
 	delete m_img;
+	delete m_puzzle;
 }
 
-int Unittest::updateImage(Image *img, bool clear)
+int Unittest::updateImage(Puzzle &puzzle, Image *img, bool clear)
 {
-	static std::vector<v2s16> oldpos;
-	if (oldpos.size() != g_pool.size())
-		oldpos.resize(g_pool.size());
-
 	Tile *center;
-	int n_tiles = Tile::sortAllUnsafe(center);
-	img->plotTile(center, clear);
+	int n_tiles = Tile::sortAllUnsafe(puzzle, center);
+	img->plotTile(puzzle, center, clear);
 	img->save("images/out.png");
 
 	return n_tiles;
 }
 
 
+void Unittest::checkKernels()
+{
+	TileStore &pool = m_puzzle->pool;
+
+	// Random faces plus the real ones from the test image
+	std::vector<Face> faces;
+	std::vector<uint8_t> colors(4096 * SEGNUM);
+	std::mt19937 rng(1234);
+	for (uint8_t &c : colors)
+		c = rng();
+	for (size_t n = 0; n < colors.size(); n += SEGNUM)
+		faces.push_back(Face { &colors[n], (uint8_t)rng() });
+
+	for (Tile *tile : pool) {
+		for (int i = 0; i < TP_TOTAL; ++i)
+			faces.push_back(tile->getFace((TILE_POS)i));
+	}
+
+	auto kernels = Face::getKernels();
+	const FaceKernel *ref = kernels[0];
+
+	for (const FaceKernel *k : kernels) {
+		for (size_t n = 0; n + 4 < faces.size(); ++n) {
+			const Face *a[4], *b[4];
+			for (int i = 0; i < 4; ++i) {
+				a[i] = &faces[n + i];
+				b[i] = &faces[faces.size() - 1 - n - i];
+			}
+
+			int expected[4], got[4];
+			ref->distance4(a, b, expected);
+			k->distance4(a, b, got);
+
+			for (int i = 0; i < 4; ++i) {
+				ASSERT(k->distance(*a[i], *b[i]) == expected[i]);
+				ASSERT(got[i] == expected[i]);
+			}
+		}
+		LOG("Kernel '" << k->name << "' matches '" << ref->name << "'");
+	}
+
+	// Precomputed table must match the direct comparison
+	const CompatMatrix &compat = m_puzzle->compat;
+	ASSERT(!compat.empty());
+	for (Tile *a : pool)
+	for (Tile *b : pool) {
+		const uint16_t *dist = compat.get(a->index, b->index);
+		for (int i = 0; i < TP_TOTAL; ++i)
+			ASSERT(dist[i] == a->getFace((TILE_POS)i).getDistance(b->getFace(swapTilePos(i))));
+	}
+}
+
+void Unittest::checkParallelBudget()
+{
+	// Nested calls must share the threads of the outer one
+	std::atomic<int> active(0), max_active(0);
+	unsigned old_budget = getThreadBudget();
+	getThreadBudget() = 8;
+
+	parallelFor(3, [&] (size_t) {
+		parallelFor(8, [&] (size_t) {
+			int n = ++active;
+			int seen = max_active;
+			while (n > seen && !max_active.compare_exchange_weak(seen, n))
+				;
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			active--;
+		});
+	});
+
+	getThreadBudget() = old_budget;
+	ASSERT(max_active > 1 && max_active <= 8);
+	LOG("Nested parallelFor used up to " << max_active << " of 8 threads");
+}
+
+void Unittest::checkFragments()
+{
+	// Random link/unlink sequence, partially rolled back. The fragment
+	// placement must always match the map generated by Tile::makeMap.
+	TileMap map;
+	Fragments &fragments = m_puzzle->fragments;
+	TileStore &pool = m_puzzle->pool;
+
+	std::mt19937 rng(42);
+	for (int n = 0; n < 2000; ++n) {
+		Tile *a = pool[rng() % pool.size()];
+		Tile *b = pool[rng() % pool.size()];
+		TILE_POS face = (TILE_POS)(rng() % TP_TOTAL);
+		if (a == b)
+			continue;
+
+		// Some changes are undone again
+		bool undo = rng() % 4 == 0;
+		Tile *old_neighbour = a->getNeighbour(face);
+		size_t old_size = fragments.getSize(a);
+		if (undo)
+			m_puzzle->begin();
+
+		if (a->getNeighbour(face) || b->getNeighbour(swapTilePos(face)))
+			a->unlink(face);
+		else
+			a->link(b, face);
+
+		if (undo) {
+			m_puzzle->rollback();
+			ASSERT(a->getNeighbour(face) == old_neighbour);
+			ASSERT(fragments.getSize(a) == old_size);
+		}
+
+		for (Tile *tile : pool) {
+			Tile *root = fragments.getRoot(tile);
+			map.clear();
+			ASSERT(root->makeMap(map, v2s32()));
+			ASSERT(map.size() == fragments.getSize(root));
+
+			const v2s32 *pos = map.getPos(tile);
+			ASSERT(pos && *pos == fragments.getOffset(tile));
+		}
+	}
+
+	for (Tile *tile : pool) {
+		for (int i = 0; i < TP_TOTAL; ++i)
+			tile->unlink((TILE_POS)i);
+	}
+	LOG("Fragments match the generated maps");
+}
+
+void Unittest::checkRanking()
+{
+	// "a" only has its left face free, "b" not its right one:
+	// no face pair to link them, which must not end up in the ranking
+	TileStore &pool = m_puzzle->pool;
+	m_puzzle->candidates.build(pool, m_puzzle->compat, pool.size());
+
+	Tile *a = pool[0], *b = pool[4];
+	ASSERT(a->link(pool[1], TP_TOP));
+	ASSERT(a->link(pool[2], TP_RIGHT));
+	ASSERT(a->link(pool[3], TP_BOTTOM));
+	ASSERT(b->link(pool[5], TP_RIGHT));
+
+	TILE_POS face;
+	ASSERT(a->getDistance(b, &face) < 0);
+
+	std::vector<RankedLink> ranking;
+	m_puzzle->ranking.update(*m_puzzle, 0, ranking);
+	ASSERT(!ranking.empty());
+	for (const RankedLink &link : ranking) {
+		ASSERT(link.face < TP_TOTAL);
+		ASSERT(!link.t1->getNeighbour(link.face));
+		ASSERT(!link.t2->getNeighbour(swapTilePos(link.face)));
+		ASSERT(!(link.t1 == a && link.t2 == b) && !(link.t1 == b && link.t2 == a));
+	}
+
+	for (Tile *tile : pool) {
+		for (int i = 0; i < TP_TOTAL; ++i)
+			tile->unlink((TILE_POS)i);
+	}
+	m_puzzle->ranking.clear();
+	m_puzzle->candidates.clear();
+	LOG("Ranking skips pairs without a free face pair");
+}
+
+void Unittest::checkSolvers()
+{
+	// Solves the test image with a fresh puzzle each
+	// out: links of each tile, as pool indices
+	auto solve = [] (int beam_width) -> std::vector<uint32_t> {
+		Puzzle puzzle;
+		Image img(testfile);
+		img.read(puzzle, v2u32(4, 4));
+		puzzle.compat.build(puzzle.pool);
+		puzzle.candidates.build(puzzle.pool, puzzle.compat, 16);
+
+		std::vector<Candidate> lists;
+		for (Tile *tile : puzzle.pool) {
+			for (int i = 0; i < TP_TOTAL; ++i) {
+				auto &list = puzzle.candidates.peek(tile, (TILE_POS)i);
+				lists.insert(lists.end(), list.begin(), list.end());
+			}
+		}
+
+		size_t merged;
+		if (beam_width > 0)
+			merged = BeamSolver(puzzle, beam_width, 16).run();
+		else
+			merged = HeapSolver(puzzle).run();
+
+		// All in one fragment, placed without overlaps
+		ASSERT(merged + 1 == puzzle.pool.size());
+		ASSERT(puzzle.getQuality().fragments == 1);
+		TileMap map;
+		ASSERT(puzzle.pool[0]->makeMap(map, v2s32()));
+		ASSERT(map.size() == puzzle.pool.size());
+
+		std::vector<uint32_t> links;
+		size_t n = 0;
+		for (Tile *tile : puzzle.pool) {
+			for (int i = 0; i < TP_TOTAL; ++i) {
+				Tile *other = tile->getNeighbour((TILE_POS)i);
+				links.push_back(other ? other->index : TILE_NONE);
+
+				// The beam search must not rebuild the lists for one beam
+				for (const Candidate &c : puzzle.candidates.peek(tile, (TILE_POS)i)) {
+					ASSERT(n < lists.size());
+					ASSERT(c.tile == lists[n].tile && c.diff == lists[n].diff);
+					n++;
+				}
+			}
+		}
+		ASSERT(n == lists.size() || beam_width == 0);
+		return links;
+	};
+
+	solve(0);
+	ASSERT(solve(1) == solve(1));
+	ASSERT(solve(8) == solve(8));
+	LOG("Heap and beam solver assemble " << testfile);
+}
+
+void Unittest::checkInputFormats()
+{
+	v2u32 size;
+	std::vector<uint8_t> rgb = decodePNG(testfile, size);
+	std::string dim = std::to_string(size.X) + " " + std::to_string(size.Y);
+
+	auto read = [] (Puzzle &puzzle, const std::string &path, const v2u32 &raw_size) {
+		Image img(path, raw_size);
+		img.read(puzzle, v2u32(4, 4));
+	};
+
+	// The same pixels as PNG, PPM and raw RGB
+	Puzzle png, ppm, raw;
+	std::string ppm_path = writeTempFile("P6\n" + dim + "\n255\n", rgb);
+	std::string raw_path = writeTempFile("", rgb);
+	read(png, testfile, v2u32());
+	read(ppm, ppm_path, v2u32());
+	read(raw, raw_path, size);
+	ASSERT(isSameFaces(png, ppm));
+	ASSERT(isSameFaces(png, raw));
+
+	// maxval 15 reads the same as its values scaled to 255
+	std::vector<uint8_t> rgb15(rgb.size()), rgb255(rgb.size());
+	for (size_t i = 0; i < rgb.size(); ++i) {
+		rgb15[i] = rgb[i] / 17;
+		rgb255[i] = rgb15[i] * 17;
+	}
+	Puzzle ppm15, ppm255;
+	std::string ppm15_path = writeTempFile("P6 " + dim + " 15\n", rgb15);
+	std::string ppm255_path = writeTempFile("P6 " + dim + " 255\n", rgb255);
+	read(ppm15, ppm15_path, v2u32());
+	read(ppm255, ppm255_path, v2u32());
+	ASSERT(isSameFaces(ppm15, ppm255));
+	ASSERT(!isSameFaces(ppm15, ppm));
+
+	for (const std::string &path : { ppm_path, raw_path, ppm15_path, ppm255_path })
+		unlink(path.c_str());
+	LOG("PNG, PPM and raw input give the same faces");
+}
+
+void Unittest::checkStreamed()
+{
+	v2u32 size;
+	std::vector<uint8_t> rgb = decodePNG(testfile, size);
+	std::string ppm_path = writeTempFile("P6 " + std::to_string(size.X) + " "
+		+ std::to_string(size.Y) + " 255\n", rgb);
+
+	// Streamed from the decoder (PNG) and from the mapped input (PPM).
+	// 5x3 tiles leave a remainder of pixels at the right and bottom.
+	for (const std::string &path : { std::string(testfile), ppm_path })
+	for (v2u32 n_tiles : { v2u32(4, 4), v2u32(5, 3), v2u32(16, 16) }) {
+		Puzzle buffered, streamed;
+		Image(path).read(buffered, n_tiles);
+		Image(path).read(streamed, n_tiles, true);
+		ASSERT(isSameFaces(buffered, streamed));
+	}
+
+	unlink(ppm_path.c_str());
+	LOG("Streamed faces match the buffered ones");
+}
+
+void Unittest::checkParallelPNG()
+{
+	Puzzle puzzle;
+	Image img(testfile);
+	img.read(puzzle, v2u32(4, 4));
+	img.plot(getTestPlacement(puzzle), true);
+
+	// 640x640 pixels: several bands
+	std::string serial_path = makeTempFile(),
+		parallel_path = makeTempFile();
+	for (int level : { -1, 1, 9 })
+	for (int filter : { -1, (int)PNG_FILTER_VALUE_NONE, (int)PNG_FILTER_VALUE_PAETH }) {
+		img.save_options.level = level;
+		img.save_options.filter = filter;
+		img.save_options.parallel = false;
+		img.save(serial_path);
+		img.save_options.parallel = true;
+		img.save(parallel_path);
+
+		v2u32 serial_size, parallel_size;
+		std::vector<uint8_t> serial = decodePNG(serial_path, serial_size);
+		std::vector<uint8_t> parallel = decodePNG(parallel_path, parallel_size);
+		ASSERT(serial_size == v2u32(640, 640));
+		ASSERT(parallel_size == serial_size);
+		ASSERT(parallel == serial);
+		ASSERT(inflateIDAT(parallel_path).size() == 640 * (640 * 3 + 1));
+	}
+
+	unlink(serial_path.c_str());
+	unlink(parallel_path.c_str());
+	LOG("Parallel PNG encoding matches the serial one");
+}
+
+void Unittest::checkBanded()
+{
+	v2u32 size;
+	std::vector<uint8_t> rgb = decodePNG(testfile, size);
+	std::string ppm_path = writeTempFile("P6 " + std::to_string(size.X) + " "
+		+ std::to_string(size.Y) + " 255\n", rgb);
+	std::string normal_path = makeTempFile(),
+		banded_path = makeTempFile();
+
+	// Spilled PNG and mapped PPM source
+	for (const std::string &path : { std::string(testfile), ppm_path }) {
+		Puzzle puzzle;
+		std::vector<TilePlacement> placed;
+		{
+			Image img(path);
+			img.read(puzzle, v2u32(4, 4));
+			placed = getTestPlacement(puzzle);
+			img.plot(placed, true);
+			img.save(normal_path);
+		}
+		{
+			Image img(path);
+			img.setTileCount(v2u32(4, 4));
+			img.saveBanded(placed, banded_path);
+		}
+
+		v2u32 normal_size, banded_size;
+		std::vector<uint8_t> normal = decodePNG(normal_path, normal_size);
+		std::vector<uint8_t> banded = decodePNG(banded_path, banded_size);
+		ASSERT(banded_size == normal_size);
+		ASSERT(banded == normal);
+	}
+
+	for (const std::string &path : { ppm_path, normal_path, banded_path })
+		unlink(path.c_str());
+	LOG("Banded output matches the normal one");
+}
+
+void Unittest::checkSolutionFile()
+{
+	Puzzle puzzle;
+	Image img(testfile);
+	img.read(puzzle, v2u32(4, 4));
+	std::string path = makeTempFile();
+
+	auto is_same = [] (const Solution &a, const Solution &b) -> bool {
+		if (a.image_size != b.image_size || a.n_tiles != b.n_tiles
+				|| a.entries.size() != b.entries.size())
+			return false;
+		for (size_t i = 0; i < a.entries.size(); ++i) {
+			const Solution::Entry &ea = a.entries[i], &eb = b.entries[i];
+			if (ea.place.original != eb.place.original || ea.place.pos != eb.place.pos
+					|| memcmp(ea.edges, eb.edges, sizeof(ea.edges)))
+				return false;
+		}
+		return true;
+	};
+
+	// 16 single tiles (widest layout), then solved into one fragment
+	Solution solution;
+	for (int solved = 0; solved < 2; ++solved) {
+		if (solved) {
+			puzzle.compat.build(puzzle.pool);
+			puzzle.candidates.build(puzzle.pool, puzzle.compat, 16);
+			HeapSolver(puzzle).run();
+		}
+		Tile *center;
+		Tile::sortAllUnsafe(puzzle, center);
+		solution.fromPuzzle(puzzle, img.size, v2u32(4, 4));
+		ASSERT(solution.entries.size() == 16);
+		ASSERT(solution.isValid());
+
+		solution.saveBinary(path);
+		Solution loaded;
+		loaded.loadBinary(path);
+		ASSERT(is_same(solution, loaded));
+
+		// Same placement as the puzzle
+		std::vector<TilePlacement> placed, expected;
+		loaded.getPlacement(placed);
+		Image::getPlacement(puzzle.mapdata, expected);
+		ASSERT(placed.size() == expected.size());
+		for (const TilePlacement &p : expected) {
+			ASSERT(std::find_if(placed.begin(), placed.end(), [&] (const TilePlacement &q) {
+				return q.original == p.original && q.pos == p.pos;
+			}) != placed.end());
+		}
+	}
+	unlink(path.c_str());
+
+	// Each change must be rejected
+	std::vector<std::function<void(Solution &)>> breakers = {
+		[] (Solution &s) { s.n_tiles = v2u32(0, 4); },
+		[] (Solution &s) { s.n_tiles = v2u32(512, 4); }, // tile width 0
+		[] (Solution &s) { s.entries[1].place.original.X += 1; }, // off the grid
+		[] (Solution &s) { s.entries[1].place.original.Y = 256; }, // outside
+		[] (Solution &s) { s.entries[1].place.original = s.entries[0].place.original; },
+		[] (Solution &s) { s.entries[1].place.pos = s.entries[0].place.pos; },
+	};
+	for (auto &f_break : breakers) {
+		Solution broken = solution;
+		f_break(broken);
+		ASSERT(!broken.isValid());
+	}
+
+	// Spans up to 4 tiles per tile of the grid are accepted
+	int32_t x_min = solution.entries[0].place.pos.X;
+	for (const Solution::Entry &entry : solution.entries)
+		x_min = std::min(x_min, entry.place.pos.X);
+	for (int32_t span : { 16 * 4 - 1, 16 * 4 }) {
+		Solution far = solution;
+		far.entries[0].place.pos = v2s32(x_min + span, 0);
+		ASSERT(far.isValid() == (span < 16 * 4));
+	}
+	LOG("Solution files reload to the same placement");
+}
+
+void Unittest::checkSnapshotLayout()
+{
+	// Fragments of various sizes, enough to wrap into several rows
+	Puzzle puzzle;
+	Image img(testfile);
+	img.read(puzzle, v2u32(8, 8));
+	TileStore &pool = puzzle.pool;
+
+	std::mt19937 rng(7);
+	for (int n = 0; n < 40; ++n) {
+		Tile *a = pool[rng() % pool.size()];
+		Tile *b = pool[rng() % pool.size()];
+		TILE_POS face = (TILE_POS)(rng() % TP_TOTAL);
+		if (a != b && !a->getNeighbour(face) && !b->getNeighbour(swapTilePos(face))
+				&& puzzle.fragments.canMerge(a, b, face))
+			a->link(b, face);
+	}
+
+	std::vector<SnapshotWriter::TileState> tiles;
+	for (Tile *tile : pool) {
+		tiles.push_back({ tile->original_pos, puzzle.fragments.getRoot(tile)->index,
+			puzzle.fragments.getOffset(tile) });
+	}
+	std::vector<TilePlacement> placed;
+	SnapshotWriter::layout(tiles, placed);
+
+	Tile *center;
+	Tile::sortAllUnsafe(puzzle, center);
+	ASSERT(placed.size() == pool.size());
+	for (Tile *tile : pool) {
+		const v2s32 *pos = puzzle.mapdata.getPos(tile);
+		ASSERT(pos && *pos == placed[tile->index].pos);
+		ASSERT(placed[tile->index].original == tile->original_pos);
+	}
+	LOG("Snapshot layout matches Tile::sortAllUnsafe");
+}
+
 void Unittest::checkSimilar()
 {
+	TileStore &pool = m_puzzle->pool;
 	auto compare_tiles = [](const std::string &name, Tile *t1, Tile *t2) {
 		TILE_POS best_face = TP_TOTAL;
 		int distance = t1->getDistance(t2, &best_face);
 		LOG(name << ": distance=" << distance << ", face=" << (int)best_face);
 	};
 
-	compare_tiles("hair     ", g_pool[ 5], g_pool[ 6]);
-	compare_tiles("white_top", g_pool[ 6], g_pool[ 9]);
-	compare_tiles("aliasing ", g_pool[10], g_pool[11]); // walkway
+	compare_tiles("hair     ", pool[ 5], pool[ 6]);
+	compare_tiles("white_top", pool[ 6], pool[ 9]);
+	compare_tiles("aliasing ", pool[10], pool[11]); // walkway
 }
 
 void Unittest::similarOverall()
 {
+	TileStore &pool = m_puzzle->pool;
 	typedef std::pair<Tile *, int> tilediff_t;
 	std::vector<tilediff_t> ranking;
 
-	Tile *main = g_pool[2];
+	Tile *main = pool[2];
 	LOG("Testing matches with tile " << PP(main->original_pos));
-	for (Tile *tile : g_pool) {
+	for (Tile *tile : pool) {
 		if (tile == main)
 			continue;
 
@@ -93,8 +682,8 @@ void Unittest::similarOverall()
 
 void Unittest::moveLink()
 {
-	/*Tile *t1 = g_pool[5];
-	Tile *t2 = g_pool[6];
+	/*Tile *t1 = pool[5];
+	Tile *t2 = pool[6];
 	TILE_POS best_face = TP_RIGHT;
 	int distance;
 
@@ -107,8 +696,8 @@ void Unittest::moveLink()
 	distance = t2->isNeighbour(t1, &best_face);
 	LOG("neighbour2? " << distance << " face=" << (int)best_face);
 
-	distance = g_pool[4]->getDistance(t2, &best_face);
+	distance = pool[4]->getDistance(t2, &best_face);
 	LOG("Simple distance: " << distance << " face: " << (int)best_face);
-	g_pool[4]->moveTo(t2->pos - tile_pos_to_dir[best_face]);
-	g_pool[4]->link(t2);*/
+	pool[4]->moveTo(t2->pos - tile_pos_to_dir[best_face]);
+	pool[4]->link(t2);*/
 }
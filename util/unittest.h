@@ -1,18 +1,31 @@
 #pragma once
 
 class Image;
+class Puzzle;
 
 class Unittest {
 public:
 	Unittest();
 	~Unittest();
-	static int updateImage(Image *img, bool clear);
+	static int updateImage(Puzzle &puzzle, Image *img, bool clear);
 
 private:
+	void checkKernels();
+	void checkParallelBudget();
+	void checkFragments();
+	void checkRanking();
+	void checkSolvers();
+	void checkInputFormats();
+	void checkStreamed();
+	void checkParallelPNG();
+	void checkBanded();
+	void checkSolutionFile();
+	void checkSnapshotLayout();
 	void checkSimilar();
 	void similarOverall();
 	void moveLink();
 	
 	
+	Puzzle *m_puzzle;
 	Image *m_img;
 };
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <type_traits>
+
 template<class T>
 class Vector2D
 {
@@ -54,7 +56,9 @@ public:
 
 	unsigned long long getHash() const
 	{
-		return (unsigned long long)X << (sizeof(X) * 8) | (unsigned long long)Y;
+		// Cast to unsigned first: negative values must not be sign-extended
+		typedef typename std::make_unsigned<T>::type U;
+		return (unsigned long long)(U)X << (sizeof(X) * 8) | (unsigned long long)(U)Y;
 	}
 
 	T X, Y;